@@ -1,156 +1,3932 @@
 // xdrabbo00
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Define constants for various errors and statuses.
+#define VALID 0
+#define INVALID_FILE 1
+#define INVALID_ARGS 2
+#define NUM_OF_ARGS 3
+#define MEMORY_ERROR 4
+
+// Number of pixels packed into one word of the bitmap.
+#define WORD_BITS 64
+
+// Index of the lowest set bit of a non-zero word.
+#define CTZ(word) __builtin_ctzll (word)
+
+// Largest number of threads a search is split into.
+#define MAX_JOBS 256
+
+// Limits of the batch mode: the length of the list of operations, the number of
+// operations in it and the number of files read before their results are printed.
+#define MAX_ARG_LENGHT 250
+#define MAX_OPERATIONS 8
+#define BATCH_ROUND 1024
+
+// Largest bitmap the benchmark checks the square search on, the original is O(N.M.S^2).
+#define BENCH_VERIFY_PIXELS 65536
+
+// Alignment of the per column counters, enough for the widest vector kernel.
+#define VECTOR_ALIGN 32
+
+// Vector kernels are built for x86 and picked at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VLINE_X86
+#include <immintrin.h>
+#endif
+
+// A bitmap with 64 pixels per word, rows stored one after another with a fixed stride.
+typedef struct {
+    int num_rows;
+    int num_cols;
+    size_t stride;
+    uint64_t *words;
+} Bitmap;
+
+// Formats of the bitmap file: the text format, plain PBM, packed PBM and run-length encoding.
+#define FORMAT_TEXT 0
+#define FORMAT_P1 1
+#define FORMAT_P4 2
+#define FORMAT_RLE 3
+
+// Size of the buffer used when the input cannot be mapped into memory.
+#define READ_CHUNK 65536
+
+// Tag at the start of a saved summed-area index and the suffix added to the bitmap name.
+#define INDEX_MAGIC "FIGSAT1"
+#define INDEX_SUFFIX ".sat"
+
+// Input of the parser: either a mapped regular file or a buffer refilled with read().
+typedef struct {
+    int fd;
+    const char *data;
+    size_t pos;
+    size_t size;
+    char *map;
+    size_t map_size;
+    int eof;
+    int format;
+    char buffer[READ_CHUNK];
+} Reader;
+
+// Bits of every byte in reverse order, PBM stores the leftmost pixel in the highest bit.
+#define REVERSE2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define REVERSE4(n) REVERSE2 (n), REVERSE2 (n + 2 * 16), REVERSE2 (n + 1 * 16), REVERSE2 (n + 3 * 16)
+#define REVERSE6(n) REVERSE4 (n), REVERSE4 (n + 2 * 4), REVERSE4 (n + 1 * 4), REVERSE4 (n + 3 * 4)
+const unsigned char bit_reverse[256] = { REVERSE6 (0), REVERSE6 (2), REVERSE6 (1), REVERSE6 (3) };
+
+// A line or a square given by its start and end corners, with its size.
+typedef struct {
+    int size;
+    int start_x;
+    int start_y;
+    int end_x;
+    int end_y;
+} Figure;
+
+// Command line options given before the operation.
+typedef struct {
+    int stream;
+    int jobs;
+    const char *batch;
+    int top;
+    int ties;
+    int index;
+    int connectivity;
+} Options;
+
+// Phases timed by --stats. Every search operation is a phase of its own from
+// PHASE_SEARCH on, in the order of stats_searches.
+#define PHASE_OPEN 0
+#define PHASE_ALLOC 1
+#define PHASE_PARSE 2
+#define PHASE_SEARCH 3
+#define SEARCH_OPERATIONS 9
+#define PHASES (PHASE_SEARCH + SEARCH_OPERATIONS)
+
+// Counters reported by --stats. They are shared by the threads of the batch mode, the
+// times are kept in nanoseconds.
+typedef struct {
+    int enabled;
+    atomic_ullong wall[PHASES];
+    atomic_ullong cpu[PHASES];
+    atomic_ullong pixels;
+    atomic_ullong candidates;
+    atomic_ullong bytes;
+} Stats;
+
+// Start of a timed phase.
+typedef struct {
+    uint64_t wall;
+    uint64_t cpu;
+} StatsClock;
+
+// Per pixel lengths of the runs of ones going right and down from that pixel.
+typedef struct {
+    int *right;
+    int *down;
+} RunTables;
+
+// State of the vertical line search. For every column it holds the length of the run
+// ending in the last row, the longest run so far and the row where that run ended.
+typedef struct VlineState VlineState;
+typedef void (*VlineKernel) (VlineState *state, const uint64_t *row, int index);
+
+struct VlineState {
+    int num_cols;
+    size_t stride;
+    int32_t *run;
+    int32_t *best;
+    int32_t *best_end;
+    VlineKernel kernel;
+};
+
+// Figures collected by the top K and ties modes.
+typedef struct {
+    Figure *items;
+    int count;
+    int capacity;
+    int limit;
+    int ties;
+    int status;
+} FigureList;
+
+// Bitmap kept in memory by the daemon with what its queries are answered from: the
+// longest run of every row and column, the run length tables and the last square found,
+// which is searched again in full when a change made it stale.
+typedef struct {
+    Bitmap bitmap;
+    Figure *row_best;
+    VlineState columns;
+    RunTables tables;
+    Figure square;
+    int square_dirty;
+} Daemon;
+
+// A range of columns [first, end). In a row of a sparse bitmap it is a run of ones and
+// start is unused, in the vertical line sweep it is a set of columns whose runs of ones
+// all began in row start.
+typedef struct {
+    int first;
+    int end;
+    int start;
+} Span;
+
+typedef struct {
+    Span *items;
+    size_t count;
+    size_t capacity;
+} SpanList;
+
+// Sparse bitmap kept as the runs of ones of every row, the runs of row r are
+// runs.items[offsets[r]] up to runs.items[offsets[r + 1]].
+typedef struct {
+    int num_rows;
+    int num_cols;
+    size_t *offsets;
+    SpanList runs;
+} RunBitmap;
+
+// Work of one thread of the component labeling: a band of rows, the first run of every
+// row and the runs with their union-find parents, shared by all bands.
+typedef struct {
+    const Bitmap *bitmap;
+    int first;
+    int last;
+    int connectivity;
+    size_t *offsets;
+    Span *runs;
+    size_t *parent;
+} LabelTask;
+
+// A connected component: its number of pixels and its bounding box.
+typedef struct {
+    uint64_t pixels;
+    int start_x;
+    int start_y;
+    int end_x;
+    int end_y;
+} Component;
+
+// Header of a saved summed-area index. The size and modification time of the bitmap
+// it was built from tell whether the index is still up to date.
+typedef struct {
+    char magic[8];
+    int64_t num_rows;
+    int64_t num_cols;
+    int64_t source_size;
+    int64_t source_sec;
+    int64_t source_nsec;
+} IndexHeader;
+
+// Summed-area table with (rows + 1) * (cols + 1) entries, the entry at (r, c) holds the
+// number of ones above and to the left of pixel (r, c). It is either allocated or a view
+// into a mapped index file.
+typedef struct {
+    int num_rows;
+    int num_cols;
+    uint64_t *sums;
+    void *map;
+    size_t map_size;
+} SumTable;
+
+// Work of one thread: a band of rows (or of words, for vline and the diagonal lines) and
+// the figure found in it.
+typedef struct {
+    const Bitmap *bitmap;
+    RunTables *tables;
+    int first;
+    int last;
+    int *carry;
+    atomic_int *shared_size;
+    int anti;
+    Figure figure;
+    int status;
+} Task;
+
+// One file of a batch and the printed results of the operations run on it.
+typedef struct Batch Batch;
+
+typedef struct {
+    char *filename;
+    char *output;
+    int status;
+    Batch *batch;
+} BatchJob;
+
+// Files waiting to be processed by a batch, and the operations to run on each of them.
+struct Batch {
+    const char *operations[MAX_OPERATIONS];
+    int count;
+    BatchJob files[BATCH_ROUND];
+    int pending;
+    atomic_int next;
+    int files_jobs;
+    int jobs;
+};
+
+// Function prototypes.
+void process (const char *filename, const char *operation, const Options *options, int *result);
+void run_tables_free (RunTables *tables);
+void vline_free (VlineState *state);
+int process_batch (const char *operations, char **filenames, int count, const Options *options);
+void print_figure (FILE *out, const char *operation, const Figure *figure);
+int parse_count (const char *text, long *value);
+int is_blank_line (const char *line);
+int is_search (const char *operation);
+int is_outline_search (const char *operation);
+void daemon_free (Daemon *daemon);
+int run_query (const char *filename, const Options *options);
+void stats_start (StatsClock *clock);
+void stats_stop (int phase, const StatsClock *clock);
+void stats_add (atomic_ullong *counter, uint64_t value);
+void stats_print (void);
+int search_phase (const char *operation);
+
+// Counters of the --stats option.
+Stats stats;
+
+// Search operations timed apart by --stats.
+const char *const stats_searches[SEARCH_OPERATIONS] = { "hline", "vline", "square", "rect", "fsquare", "dline", "adline", "components", "query" };
+
+#ifdef FIGSEARCH_BENCH
+// Kernel forced by the benchmark when it checks every vertical line kernel.
+VlineKernel bench_kernel = NULL;
+int benchmark (int argc, char *argv[], const Options *options);
+#endif
+
+/**
+ * Main function to start the program.
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments.
+ * @return Status code indicating the result of the program execution.
+ */
+int main(int argc, char *argv[]) {
+    Options options = {0};
+    int first = 1;
+
+    // Options go before the operation.
+    options.jobs = 1;
+    options.connectivity = 4;
+    while (first < argc) {
+        if (strcmp (argv[first], "--stream") == 0) {
+            options.stream = 1;
+        } else if (strcmp (argv[first], "-j") == 0 && first + 1 < argc) {
+            long jobs;
+            if (!parse_count (argv[++first], &jobs)) {
+                fprintf (stderr, "Invalid arguments\n");
+                return INVALID_ARGS;
+            }
+            options.jobs = jobs == 0 ? (int)sysconf (_SC_NPROCESSORS_ONLN) : (jobs > MAX_JOBS ? MAX_JOBS : (int)jobs);
+        } else if (strcmp (argv[first], "--top") == 0 && first + 1 < argc) {
+            long top;
+            if (!parse_count (argv[++first], &top) || top == 0) {
+                fprintf (stderr, "Invalid arguments\n");
+                return INVALID_ARGS;
+            }
+            options.top = top > INT_MAX ? INT_MAX : (int)top;
+        } else if (strcmp (argv[first], "--ties") == 0) {
+            options.ties = 1;
+        } else if (strcmp (argv[first], "--index") == 0) {
+            options.index = 1;
+        } else if (strcmp (argv[first], "--conn") == 0 && first + 1 < argc) {
+            long connectivity;
+            if (!parse_count (argv[++first], &connectivity) || (connectivity != 4 && connectivity != 8)) {
+                fprintf (stderr, "Invalid arguments\n");
+                return INVALID_ARGS;
+            }
+            options.connectivity = (int)connectivity;
+        } else if (strcmp (argv[first], "--stats") == 0) {
+            stats.enabled = 1;
+#ifdef FIGSEARCH_BENCH
+        } else if (strcmp (argv[first], "--bench") == 0) {
+            return benchmark (argc - first - 1, argv + first + 1, &options);
+#endif
+        } else if (strcmp (argv[first], "--batch") == 0 && first + 1 < argc) {
+            options.batch = argv[++first];
+        } else {
+            break;
+        }
+        first++;
+    }
+
+    // In batch mode the remaining arguments are all filenames.
+    if (options.batch != NULL) {
+        int result = process_batch (options.batch, first < argc ? argv + first : NULL, argc - first, &options);
+        if (result == INVALID_ARGS) {
+            fprintf (stderr, "Invalid arguments\n");
+        }
+        if (stats.enabled) {
+            stats_print ();
+        }
+        return result;
+    }
+
+    // Check if the number of arguments is correct.
+    if (argc - first + 1 != NUM_OF_ARGS) {
+        fprintf (stderr, "Invalid arguments\n");
+        return INVALID_ARGS;
+    }
+
+    int result;
+    // Process the input file and operation.
+    process(argv[first + 1], argv[first], &options, &result);
+
+    // Handle the result.
+    switch (result) {
+        case VALID:
+            if (strcmp (argv[first], "test") == 0) {
+                fprintf (stdout, "Valid\n");
+            }
+            break;
+
+        case INVALID_FILE:
+            fprintf (stderr, "Invalid\n");
+            break;
+
+        case MEMORY_ERROR:
+            fprintf (stderr, "Allocation failure\n");
+            break;
+
+        default:
+            fprintf (stderr, "Unkown error\n");
+            break;
+    }
+
+    if (stats.enabled) {
+        stats_print ();
+    }
+    return result;
+}
+
+/**
+ * Function to parse a non-negative number given on the command line.
+ * @param text The argument.
+ * @param value Pointer to store the number.
+ * @return 1 if the whole argument is a non-negative number, 0 otherwise.
+ */
+int parse_count (const char *text, long *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtol (text, &end, 10);
+    return end != text && *end == '\0' && *value >= 0 && errno == 0;
+}
+
+/**
+ * Function to check whether a line read from the standard input has only white space.
+ * @param line The line.
+ * @return 1 if the line is empty or white space, 0 otherwise.
+ */
+int is_blank_line (const char *line) {
+    while (isspace ((unsigned char)*line)) {
+        line++;
+    }
+    return *line == '\0';
+}
+
+/**
+ * Function to read a clock in nanoseconds.
+ * @param id Clock to read.
+ * @return Time in nanoseconds.
+ */
+uint64_t stats_clock (clockid_t id) {
+    struct timespec now;
+    clock_gettime (id, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Function to start timing a phase, it does nothing without --stats.
+ * @param clock Pointer to store the start of the phase.
+ */
+void stats_start (StatsClock *clock) {
+    if (stats.enabled) {
+        clock->wall = stats_clock (CLOCK_MONOTONIC);
+        clock->cpu = stats_clock (CLOCK_PROCESS_CPUTIME_ID);
+    }
+}
+
+/**
+ * Function to add the time since the start of a phase to its totals. The CPU time
+ * is that of the whole process, so it includes the threads of a parallel search.
+ * @param phase One of the PHASE constants.
+ * @param clock Start of the phase.
+ */
+void stats_stop (int phase, const StatsClock *clock) {
+    if (stats.enabled && phase >= 0) {
+        atomic_fetch_add_explicit (&stats.wall[phase], stats_clock (CLOCK_MONOTONIC) - clock->wall, memory_order_relaxed);
+        atomic_fetch_add_explicit (&stats.cpu[phase], stats_clock (CLOCK_PROCESS_CPUTIME_ID) - clock->cpu, memory_order_relaxed);
+    }
+}
+
+/**
+ * Function to add to one of the counters, it does nothing without --stats.
+ * @param counter The counter.
+ * @param value Value to add.
+ */
+void stats_add (atomic_ullong *counter, uint64_t value) {
+    if (stats.enabled) {
+        atomic_fetch_add_explicit (counter, value, memory_order_relaxed);
+    }
+}
+
+/**
+ * Function to print the counters of --stats to stderr, one key=value pair per line.
+ */
+void stats_print (void) {
+    const char *names[PHASE_SEARCH] = { "open", "alloc", "parse" };
+    uint64_t wall = 0, cpu = 0;
+    struct rusage usage;
+
+    for (int phase = 0; phase < PHASE_SEARCH; phase++) {
+        fprintf (stderr, "%s_wall_s=%.6f\n", names[phase], atomic_load (&stats.wall[phase]) / 1e9);
+        fprintf (stderr, "%s_cpu_s=%.6f\n", names[phase], atomic_load (&stats.cpu[phase]) / 1e9);
+    }
+    for (int phase = PHASE_SEARCH; phase < PHASES; phase++) {
+        wall += atomic_load (&stats.wall[phase]);
+        cpu += atomic_load (&stats.cpu[phase]);
+    }
+    fprintf (stderr, "search_wall_s=%.6f\n", wall / 1e9);
+    fprintf (stderr, "search_cpu_s=%.6f\n", cpu / 1e9);
+    for (int phase = PHASE_SEARCH; phase < PHASES; phase++) {
+        const char *name = stats_searches[phase - PHASE_SEARCH];
+        fprintf (stderr, "search_%s_wall_s=%.6f\n", name, atomic_load (&stats.wall[phase]) / 1e9);
+        fprintf (stderr, "search_%s_cpu_s=%.6f\n", name, atomic_load (&stats.cpu[phase]) / 1e9);
+    }
+    fprintf (stderr, "pixels=%llu\n", atomic_load (&stats.pixels));
+    fprintf (stderr, "square_candidates=%llu\n", atomic_load (&stats.candidates));
+    fprintf (stderr, "bytes_read=%llu\n", atomic_load (&stats.bytes));
+    getrusage (RUSAGE_SELF, &usage);
+    fprintf (stderr, "peak_rss_kb=%ld\n", usage.ru_maxrss);
+}
+
+/**
+ * Function to find the --stats phase of a search operation.
+ * @param operation The operation.
+ * @return The phase, -1 if the operation is not timed as a search.
+ */
+int search_phase (const char *operation) {
+    for (int index = 0; index < SEARCH_OPERATIONS; index++) {
+        if (strcmp (operation, stats_searches[index]) == 0) {
+            return PHASE_SEARCH + index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Function to allocate an empty bitmap of the given size.
+ * @param bitmap Bitmap to initialize.
+ * @param num_rows Number of rows in the bitmap.
+ * @param num_cols Number of columns in the bitmap.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int bitmap_init (Bitmap *bitmap, int num_rows, int num_cols) {
+    bitmap->num_rows = num_rows;
+    bitmap->num_cols = num_cols;
+    bitmap->stride = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+
+    // One contiguous, zeroed block; the padding bits after the last column stay zero.
+    bitmap->words = calloc ((size_t)num_rows * bitmap->stride, sizeof(uint64_t));
+    if (bitmap->words == NULL) {
+        return MEMORY_ERROR;
+    }
+    return VALID;
+}
+
+/**
+ * Function to free the memory of the bitmap.
+ * @param bitmap Bitmap to free.
+ */
+void bitmap_free (Bitmap *bitmap) {
+    free (bitmap->words);
+    bitmap->words = NULL;
+}
+
+/**
+ * Function to get a pointer to the first word of a bitmap row.
+ * @param bitmap Bitmap.
+ * @param row Index of the row.
+ * @return Pointer to the packed row.
+ */
+uint64_t *bitmap_row (const Bitmap *bitmap, int row) {
+    return bitmap->words + (size_t)row * bitmap->stride;
+}
+
+/**
+ * Function to read one pixel of the bitmap.
+ * @param bitmap Bitmap.
+ * @param row Index of the row.
+ * @param col Index of the column.
+ * @return 1 if the pixel is set, 0 otherwise.
+ */
+int bitmap_get (const Bitmap *bitmap, int row, int col) {
+    return (bitmap_row (bitmap, row)[col / WORD_BITS] >> (col % WORD_BITS)) & 1;
+}
+
+/**
+ * Function to set one pixel of the bitmap.
+ * @param bitmap Bitmap.
+ * @param row Index of the row.
+ * @param col Index of the column.
+ */
+void bitmap_set (Bitmap *bitmap, int row, int col) {
+    bitmap_row (bitmap, row)[col / WORD_BITS] |= (uint64_t)1 << (col % WORD_BITS);
+}
+
+/**
+ * Function to find the next set pixel in a packed row.
+ * @param row Packed row.
+ * @param from Column to start the search at.
+ * @param num_cols Number of columns in the row.
+ * @return Column of the next set pixel, or num_cols if there is none.
+ */
+int next_one (const uint64_t *row, int from, int num_cols) {
+    if (from >= num_cols) {
+        return num_cols;
+    }
+
+    size_t words = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+    size_t word = from / WORD_BITS;
+    uint64_t bits = row[word] & (~(uint64_t)0 << (from % WORD_BITS));
+
+    while (bits == 0) {
+        if (++word == words) {
+            return num_cols;
+        }
+        bits = row[word];
+    }
+    return (int)(word * WORD_BITS) + CTZ (bits);
+}
+
+/**
+ * Function to find the next unset pixel in a packed row.
+ * @param row Packed row.
+ * @param from Column to start the search at.
+ * @param num_cols Number of columns in the row.
+ * @return Column of the next unset pixel, or num_cols if the row is set up to its end.
+ */
+int next_zero (const uint64_t *row, int from, int num_cols) {
+    if (from >= num_cols) {
+        return num_cols;
+    }
+
+    size_t words = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+    size_t word = from / WORD_BITS;
+    uint64_t bits = ~row[word] & (~(uint64_t)0 << (from % WORD_BITS));
+
+    while (bits == 0) {
+        if (++word == words) {
+            return num_cols;
+        }
+        bits = ~row[word];
+    }
+
+    int col = (int)(word * WORD_BITS) + CTZ (bits);
+    return col < num_cols ? col : num_cols;
+}
+
+/**
+ * Function to open the input for reading. Regular files are mapped into memory,
+ * anything else (pipes, terminals) is read in chunks with read().
+ * @param reader Reader to initialize.
+ * @param filename Name of the text file, "-" for the standard input.
+ * @return VALID on success, INVALID_FILE if the file cannot be opened.
+ */
+int reader_open (Reader *reader, const char *filename) {
+    struct stat info;
+    StatsClock clock;
+
+    stats_start (&clock);
+    reader->fd = strcmp (filename, "-") == 0 ? dup (STDIN_FILENO) : open (filename, O_RDONLY);
+    if (reader->fd < 0) {
+        return INVALID_FILE;
+    }
+
+    reader->data = reader->buffer;
+    reader->pos = 0;
+    reader->size = 0;
+    reader->map = NULL;
+    reader->map_size = 0;
+    reader->eof = 0;
+    reader->format = FORMAT_TEXT;
+
+    if (fstat (reader->fd, &info) == 0 && S_ISREG (info.st_mode) && info.st_size > 0) {
+        void *map = mmap (NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise (map, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_size = (size_t)info.st_size;
+            reader->data = map;
+            reader->size = reader->map_size;
+            reader->eof = 1;
+        }
+    }
+    stats_stop (PHASE_OPEN, &clock);
+    return VALID;
+}
+
+/**
+ * Function to close the input.
+ * @param reader Reader to close.
+ */
+void reader_close (Reader *reader) {
+    if (reader->map != NULL) {
+        // Only the part of a mapped file the parser got to counts as read.
+        stats_add (&stats.bytes, reader->pos);
+        munmap (reader->map, reader->map_size);
+    }
+    close (reader->fd);
+}
+
+/**
+ * Function to refill the read buffer once all of it has been consumed.
+ * @param reader Reader.
+ * @return 1 if there are new bytes available, 0 at the end of the input.
+ */
+int reader_fill (Reader *reader) {
+    while (!reader->eof) {
+        ssize_t count = read (reader->fd, reader->buffer, READ_CHUNK);
+        if (count > 0) {
+            reader->pos = 0;
+            reader->size = (size_t)count;
+            stats_add (&stats.bytes, (uint64_t)count);
+            return 1;
+        }
+        if (count == 0 || errno != EINTR) {
+            reader->eof = 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function to look at the next byte of the input without consuming it.
+ * @param reader Reader.
+ * @return The next byte, or EOF at the end of the input.
+ */
+int reader_peek (Reader *reader) {
+    if (reader->pos == reader->size && !reader_fill (reader)) {
+        return EOF;
+    }
+    return (unsigned char)reader->data[reader->pos];
+}
+
+/**
+ * Function to read one decimal integer, accepting the same input as fscanf("%d").
+ * @param reader Reader.
+ * @param value Pointer to store the value, saturated to INT_MAX + 1 on overflow.
+ * @return 1 if an integer was read, 0 otherwise.
+ */
+int reader_int (Reader *reader, long *value) {
+    int c = reader_peek (reader);
+    int negative = 0;
+    int digits = 0;
+
+    while (c != EOF && isspace (c)) {
+        reader->pos++;
+        c = reader_peek (reader);
+    }
+
+    if (c == '+' || c == '-') {
+        negative = c == '-';
+        reader->pos++;
+        c = reader_peek (reader);
+    }
+
+    *value = 0;
+    while (c >= '0' && c <= '9') {
+        if (*value <= INT_MAX) {
+            *value = *value * 10 + (c - '0');
+        }
+        digits++;
+        reader->pos++;
+        c = reader_peek (reader);
+    }
+
+    if (*value > INT_MAX) {
+        *value = (long)INT_MAX + 1;
+    }
+    if (negative) {
+        *value = -*value;
+    }
+    return digits > 0;
+}
+
+/**
+ * Function to check that nothing but white space follows the last value. The text
+ * format allows only blanks and a line end, PBM files any white space.
+ * @param reader Reader.
+ * @return VALID if there is no trailing garbage, INVALID_FILE otherwise.
+ */
+int reader_check_end (Reader *reader) {
+    int c;
+
+    if (reader->format != FORMAT_TEXT) {
+        while ((c = reader_peek (reader)) != EOF && isspace (c)) {
+            reader->pos++;
+        }
+        return c == EOF ? VALID : INVALID_FILE;
+    }
+
+    while (isblank (c = reader_peek (reader))) {
+        reader->pos++;
+    }
+
+    if (c != EOF && c != '\n' && c != '\r') {
+        return INVALID_FILE;
+    }
+    return VALID;
+}
+
+/**
+ * Function to skip white space and comments of a PBM file.
+ * @param reader Reader.
+ * @return The next byte that is neither, or EOF.
+ */
+int pbm_skip (Reader *reader) {
+    int c;
+
+    while ((c = reader_peek (reader)) != EOF) {
+        if (c == '#') {
+            while ((c = reader_peek (reader)) != EOF && c != '\n' && c != '\r') {
+                reader->pos++;
+            }
+        } else if (isspace (c)) {
+            reader->pos++;
+        } else {
+            break;
+        }
+    }
+    return c;
+}
+
+/**
+ * Function to read one dimension from the header of a PBM file.
+ * @param reader Reader.
+ * @param value Pointer to store the dimension.
+ * @return VALID if the dimension is a positive number, INVALID_FILE otherwise.
+ */
+int pbm_dimension (Reader *reader, int *value) {
+    long number = 0;
+    int c = pbm_skip (reader);
+
+    if (c < '0' || c > '9') {
+        return INVALID_FILE;
+    }
+    while (c >= '0' && c <= '9') {
+        number = number * 10 + (c - '0');
+        if (number > INT_MAX) {
+            return INVALID_FILE;
+        }
+        reader->pos++;
+        c = reader_peek (reader);
+    }
+
+    *value = (int)number;
+    return number > 0 ? VALID : INVALID_FILE;
+}
+
+/**
+ * Function to read and check the size header of the bitmap. Besides the text format
+ * (rows, columns and the pixel values), plain (P1) and packed (P4) PBM files are
+ * accepted; their header gives the width first. Run-length encoded files have the
+ * text header after the RLE tag.
+ * @param reader Reader.
+ * @param num_rows Pointer to store the number of rows.
+ * @param num_cols Pointer to store the number of columns.
+ * @return VALID if the header is valid, INVALID_FILE otherwise.
+ */
+int read_header (Reader *reader, int *num_rows, int *num_cols) {
+    long rows, cols;
+
+    if (reader_peek (reader) == 'P') {
+        reader->pos++;
+        int magic = reader_peek (reader);
+        if (magic != '1' && magic != '4') {
+            return INVALID_FILE;
+        }
+        reader->pos++;
+        reader->format = magic == '1' ? FORMAT_P1 : FORMAT_P4;
+
+        if (!isspace (reader_peek (reader)) && reader_peek (reader) != '#') {
+            return INVALID_FILE;
+        }
+        if (pbm_dimension (reader, num_cols) != VALID || pbm_dimension (reader, num_rows) != VALID) {
+            return INVALID_FILE;
+        }
+
+        // The packed pixels start right after a single white space character.
+        if (reader->format == FORMAT_P4) {
+            int c = reader_peek (reader);
+            if (c == EOF || !isspace (c)) {
+                return INVALID_FILE;
+            }
+            reader->pos++;
+        }
+        return VALID;
+    }
+
+    // Run-length encoded files start with RLE followed by the rows and the columns.
+    if (reader_peek (reader) == 'R') {
+        const char *magic = "RLE";
+        for (int index = 0; magic[index] != '\0'; index++, reader->pos++) {
+            if (reader_peek (reader) != magic[index]) {
+                return INVALID_FILE;
+            }
+        }
+        if (!isspace (reader_peek (reader))) {
+            return INVALID_FILE;
+        }
+        reader->format = FORMAT_RLE;
+    }
+
+    if (!reader_int (reader, &rows) || !reader_int (reader, &cols) || rows <= 0 || cols <= 0 || rows > INT_MAX || cols > INT_MAX) {
+        return INVALID_FILE;
+    }
+    *num_rows = (int)rows;
+    *num_cols = (int)cols;
+    return VALID;
+}
+
+/**
+ * Function to read one row of a plain PBM file, pixels are single 0 and 1 characters.
+ * @param reader Reader.
+ * @param row Packed row to fill, all of its words are overwritten.
+ * @param num_cols Number of columns in the row.
+ * @return VALID if the row is valid, INVALID_FILE otherwise.
+ */
+int read_row_p1 (Reader *reader, uint64_t *row, int num_cols) {
+    uint64_t word = 0;
+
+    for (int col = 0; col < num_cols; col++) {
+        int c = pbm_skip (reader);
+        if (c != '0' && c != '1') {
+            return INVALID_FILE;
+        }
+        reader->pos++;
+        word |= (uint64_t)(c - '0') << (col % WORD_BITS);
+
+        if (col % WORD_BITS == WORD_BITS - 1 || col == num_cols - 1) {
+            row[col / WORD_BITS] = word;
+            word = 0;
+        }
+    }
+    return VALID;
+}
+
+/**
+ * Function to read one row of a packed PBM file. Its bytes are copied straight from the
+ * mapped file, only the order of the bits in each byte is reversed.
+ * @param reader Reader.
+ * @param row Packed row to fill, all of its words are overwritten.
+ * @param num_cols Number of columns in the row.
+ * @return VALID if the row is complete, INVALID_FILE otherwise.
+ */
+int read_row_p4 (Reader *reader, uint64_t *row, int num_cols) {
+    size_t bytes = ((size_t)num_cols + 7) / 8;
+    size_t words = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+    size_t done = 0;
+
+    memset (row, 0, words * sizeof(uint64_t));
+    while (done < bytes) {
+        if (reader->pos == reader->size && !reader_fill (reader)) {
+            return INVALID_FILE;
+        }
+
+        size_t count = reader->size - reader->pos < bytes - done ? reader->size - reader->pos : bytes - done;
+        const unsigned char *data = (const unsigned char *)reader->data + reader->pos;
+        for (size_t index = 0; index < count; index++, done++) {
+            row[done / 8] |= (uint64_t)bit_reverse[data[index]] << (8 * (done % 8));
+        }
+        reader->pos += count;
+    }
+
+    // The bits padding the last byte are not pixels.
+    if (num_cols % WORD_BITS != 0) {
+        row[words - 1] &= ((uint64_t)1 << (num_cols % WORD_BITS)) - 1;
+    }
+    return VALID;
+}
+
+/**
+ * Function to read the number of runs at the start of a run-length encoded row.
+ * @param reader Reader.
+ * @param num_cols Number of columns in the row.
+ * @param count Pointer to store the number of runs.
+ * @return VALID if the number is valid, INVALID_FILE otherwise.
+ */
+int read_rle_count (Reader *reader, int num_cols, int *count) {
+    long value;
+
+    if (!reader_int (reader, &value) || value < 0 || value > num_cols) {
+        return INVALID_FILE;
+    }
+    *count = (int)value;
+    return VALID;
+}
+
+/**
+ * Function to read one <start> <length> run of a run-length encoded row. Runs go from
+ * left to right and must not overlap, touching runs are joined by the caller.
+ * @param reader Reader.
+ * @param num_cols Number of columns in the row.
+ * @param run Pointer to the run, its end is the end of the previous run on input.
+ * @return VALID if the run is valid, INVALID_FILE otherwise.
+ */
+int read_rle_run (Reader *reader, int num_cols, Span *run) {
+    long start, length;
+
+    if (!reader_int (reader, &start) || !reader_int (reader, &length) || start < run->end || length <= 0 || start + length > num_cols) {
+        return INVALID_FILE;
+    }
+    run->first = (int)start;
+    run->end = (int)(start + length);
+    return VALID;
+}
+
+/**
+ * Function to set the pixels [first, end) of a packed row.
+ * @param row Packed row.
+ * @param first First column to set.
+ * @param end Column after the last one to set.
+ */
+void row_set_range (uint64_t *row, int first, int end) {
+    while (first < end) {
+        int bit = first % WORD_BITS;
+        int count = end - first < WORD_BITS - bit ? end - first : WORD_BITS - bit;
+        uint64_t mask = count == WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1) << bit;
+
+        row[first / WORD_BITS] |= mask;
+        first += count;
+    }
+}
+
+/**
+ * Function to read one row of a run-length encoded file into a packed row.
+ * @param reader Reader.
+ * @param row Packed row to fill, all of its words are overwritten.
+ * @param num_cols Number of columns in the row.
+ * @return VALID if the row is valid, INVALID_FILE otherwise.
+ */
+int read_row_rle (Reader *reader, uint64_t *row, int num_cols) {
+    Span run = {0, 0, 0};
+    int count;
+
+    memset (row, 0, ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t));
+    if (read_rle_count (reader, num_cols, &count) != VALID) {
+        return INVALID_FILE;
+    }
+    for (int index = 0; index < count; index++) {
+        if (read_rle_run (reader, num_cols, &run) != VALID) {
+            return INVALID_FILE;
+        }
+        row_set_range (row, run.first, run.end);
+    }
+    return VALID;
+}
+
+/**
+ * Function to read one row of pixels into a packed row.
+ * @param reader Reader.
+ * @param row Packed row to fill, all of its words are overwritten.
+ * @param num_cols Number of columns in the row.
+ * @return VALID if the row is valid, INVALID_FILE otherwise.
+ */
+int read_row (Reader *reader, uint64_t *row, int num_cols) {
+    uint64_t word = 0;
+    long value;
+
+    if (reader->format == FORMAT_P4) {
+        return read_row_p4 (reader, row, num_cols);
+    }
+    if (reader->format == FORMAT_P1) {
+        return read_row_p1 (reader, row, num_cols);
+    }
+    if (reader->format == FORMAT_RLE) {
+        return read_row_rle (reader, row, num_cols);
+    }
+
+    for (int col = 0; col < num_cols; col++) {
+        if (!reader_int (reader, &value) || (value != 0 && value != 1)) {
+            return INVALID_FILE;
+        }
+        word |= (uint64_t)value << (col % WORD_BITS);
+
+        if (col % WORD_BITS == WORD_BITS - 1 || col == num_cols - 1) {
+            row[col / WORD_BITS] = word;
+            word = 0;
+        }
+    }
+    return VALID;
+}
+
+/**  
+ * Function to chcek the validity of the bitmap file and read its content.
+ * The whole input is validated in a single pass over the mapped (or read) bytes.
+ * @param filename Name of the text file.
+ * @param bitmap Pointer to store the packed bitmap.
+ * @return VALID if the file is valid, 
+ *         INVALID_FILE if the file is invalid,
+ *         MEMORY_ERROR if there is a memory allocation failure.
+*/
+int validity_check(const char *filename, Bitmap *bitmap) {
+    Reader reader;
+    int num_rows, num_cols;
+
+    if (reader_open (&reader, filename) != VALID) {
+        return INVALID_FILE;
+    }
+
+    // Read the number of rows and columns.
+    if (read_header (&reader, &num_rows, &num_cols) != VALID) {
+        reader_close (&reader);
+        return INVALID_FILE;
+    }
+
+    // Allocate memory for the bitmap. 
+    StatsClock clock;
+    stats_start (&clock);
+    if (bitmap_init (bitmap, num_rows, num_cols) != VALID) {
+        reader_close (&reader);
+        return MEMORY_ERROR;
+    }
+    stats_stop (PHASE_ALLOC, &clock);
+
+    // Read the bitmap values and check for extra characters after them.
+    int status = VALID;
+    stats_start (&clock);
+    for (int row = 0; row < num_rows && status == VALID; row++) {
+        status = read_row (&reader, bitmap_row (bitmap, row), num_cols);
+    }
+    if (status == VALID) {
+        status = reader_check_end (&reader);
+    }
+    stats_stop (PHASE_PARSE, &clock);
+    stats_add (&stats.pixels, (uint64_t)num_rows * (uint64_t)num_cols);
+
+    reader_close (&reader);
+    if (status != VALID) {
+        bitmap_free (bitmap);
+    }
+    return status;
+}
+
+/**
+ * Function to check one row of pixels without storing it.
+ * @param reader Reader.
+ * @param num_cols Number of columns in the row.
+ * @return VALID if the row is valid, INVALID_FILE otherwise.
+ */
+int skip_row (Reader *reader, int num_cols) {
+    long value;
+    int count;
+
+    switch (reader->format) {
+        case FORMAT_P4: {
+            // Packed rows are valid as long as all of their bytes are there.
+            size_t bytes = ((size_t)num_cols + 7) / 8;
+            while (bytes > 0) {
+                if (reader->pos == reader->size && !reader_fill (reader)) {
+                    return INVALID_FILE;
+                }
+                size_t count = reader->size - reader->pos < bytes ? reader->size - reader->pos : bytes;
+                reader->pos += count;
+                bytes -= count;
+            }
+            return VALID;
+        }
+
+        case FORMAT_P1:
+            for (int col = 0; col < num_cols; col++) {
+                int c = pbm_skip (reader);
+                if (c != '0' && c != '1') {
+                    return INVALID_FILE;
+                }
+                reader->pos++;
+            }
+            return VALID;
+
+        case FORMAT_RLE: {
+            Span run = {0, 0, 0};
+            if (read_rle_count (reader, num_cols, &count) != VALID) {
+                return INVALID_FILE;
+            }
+            for (int index = 0; index < count; index++) {
+                if (read_rle_run (reader, num_cols, &run) != VALID) {
+                    return INVALID_FILE;
+                }
+            }
+            return VALID;
+        }
+
+        default:
+            for (int col = 0; col < num_cols; col++) {
+                if (!reader_int (reader, &value) || (value != 0 && value != 1)) {
+                    return INVALID_FILE;
+                }
+            }
+            return VALID;
+    }
+}
+
+/**
+ * Function to check the validity of the bitmap file in a single pass, without
+ * allocating anything; the reader and its buffer are all the memory it needs.
+ * @param filename Name of the bitmap file, - for the standard input.
+ * @return VALID if the file is valid, INVALID_FILE otherwise.
+ */
+int validate_file (const char *filename) {
+    Reader reader;
+    StatsClock clock;
+    int num_rows, num_cols;
+
+    if (reader_open (&reader, filename) != VALID) {
+        return INVALID_FILE;
+    }
+
+    stats_start (&clock);
+    int status = read_header (&reader, &num_rows, &num_cols);
+    for (int row = 0; row < num_rows && status == VALID; row++) {
+        status = skip_row (&reader, num_cols);
+    }
+    if (status == VALID) {
+        status = reader_check_end (&reader);
+        stats_add (&stats.pixels, (uint64_t)num_rows * (uint64_t)num_cols);
+    }
+    stats_stop (PHASE_PARSE, &clock);
+
+    reader_close (&reader);
+    return status;
+}
+
+/**
+ * Function to run the same work on several tasks at once, one thread per task. The
+ * first task runs in the calling thread, and a task whose thread cannot be started
+ * runs there as well, so the work is always done.
+ * @param work Function doing the work of one task.
+ * @param tasks Array of tasks.
+ * @param task_size Size of one task.
+ * @param count Number of tasks, at most MAX_JOBS.
+ */
+void run_parallel (void *(*work) (void *), void *tasks, size_t task_size, int count) {
+    pthread_t threads[MAX_JOBS];
+    int started[MAX_JOBS] = {0};
+
+    for (int index = 1; index < count; index++) {
+        started[index] = pthread_create (&threads[index], NULL, work, (char *)tasks + index * task_size) == 0;
+    }
+
+    work (tasks);
+    for (int index = 1; index < count; index++) {
+        if (started[index]) {
+            pthread_join (threads[index], NULL);
+        } else {
+            work ((char *)tasks + index * task_size);
+        }
+    }
+}
+
+/**
+ * Function to split a range into nearly equal bands, one per task.
+ * @param tasks Array of tasks to store the bands into.
+ * @param count Number of tasks.
+ * @param length Length of the range.
+ */
+void split_bands (Task *tasks, int count, int length) {
+    for (int index = 0; index < count; index++) {
+        tasks[index].first = (int)((long long)length * index / count);
+        tasks[index].last = (int)((long long)length * (index + 1) / count);
+        tasks[index].figure.size = 0;
+        tasks[index].status = VALID;
+    }
+}
+
+/**
+ * Function to get the number of tasks to split a range into.
+ * @param jobs Requested number of threads.
+ * @param length Length of the range.
+ * @return Number of tasks, at least 1.
+ */
+int task_count (int jobs, int length) {
+    int count = jobs < length ? jobs : length;
+    if (count > MAX_JOBS) {
+        count = MAX_JOBS;
+    }
+    return count > 0 ? count : 1;
+}
+
+/**
+ * Function to check whether a figure beats the best one found so far: it has to be
+ * larger, or as large and start in a smaller row, or in the same row and a smaller column.
+ * @param best Best figure found so far.
+ * @param size Size of the candidate.
+ * @param start_x Starting x-coordinate of the candidate.
+ * @param start_y Starting y-coordinate of the candidate.
+ * @return 1 if the candidate is better, 0 otherwise.
+ */
+int figure_better (const Figure *best, int size, int start_x, int start_y) {
+    return size > best->size || (size == best->size && (start_x < best->start_x || (start_x == best->start_x && start_y < best->start_y)));
+}
+
+/**
+ * Function to merge the figure found by one task into the overall result. The result
+ * does not depend on the order the tasks are merged in.
+ * @param best Best figure found so far.
+ * @param candidate Figure found by the task.
+ */
+void figure_merge (Figure *best, const Figure *candidate) {
+    if (candidate->size > 0 && figure_better (best, candidate->size, candidate->start_x, candidate->start_y)) {
+        *best = *candidate;
+    }
+}
+
+/**
+ * Function to update the longest horizontal line with the runs of one row.
+ * @param best Longest line found so far.
+ * @param row Packed row.
+ * @param index Index of the row.
+ * @param num_cols Number of columns in the row.
+ */
+void hline_scan_row (Figure *best, const uint64_t *row, int index, int num_cols) {
+    int col = 0;
+
+    // Jump from run to run; rows are scanned in order, so the first longest run wins ties.
+    while ((col = next_one (row, col, num_cols)) < num_cols) {
+        int run_end = next_zero (row, col, num_cols);
+
+        if (run_end - col > best->size) {
+            best->size = run_end - col;
+            best->start_x = index;
+            best->start_y = col;
+            best->end_x = index;
+            best->end_y = run_end - 1;
+        }
+        col = run_end;
+    }
+}
+
+/**
+ * Work of one horizontal line task: search its band of rows.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *hline_task (void *argument) {
+    Task *task = argument;
+    for (int index = task->first; index < task->last; index++) {
+        hline_scan_row (&task->figure, bitmap_row (task->bitmap, index), index, task->bitmap->num_cols);
+    }
+    return NULL;
+}
+
+/**  
+ * Function to find the longest horizontal line in the bitmap.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads, each searching a band of rows.
+ * @param figure Pointer to store the line.
+ * @return Lenght of the longest horizontal line found. 
+ * */
+int find_hline (const Bitmap *bitmap, int jobs, Figure *figure) {
+    Task tasks[MAX_JOBS];
+    int count = task_count (jobs, bitmap->num_rows);
+
+    split_bands (tasks, count, bitmap->num_rows);
+    for (int index = 0; index < count; index++) {
+        tasks[index].bitmap = bitmap;
+    }
+    run_parallel (hline_task, tasks, sizeof(Task), count);
+
+    figure->size = 0;
+    for (int index = 0; index < count; index++) {
+        figure_merge (figure, &tasks[index].figure);
+    }
+    return figure->size;
+}
+
+/**
+ * Vertical line kernel without vector instructions.
+ * @param state State of the search.
+ * @param row Packed row.
+ * @param index Index of the row.
+ */
+void vline_row_scalar (VlineState *state, const uint64_t *row, int index) {
+    for (size_t word = 0; word < state->stride; word++) {
+        uint64_t bits = row[word];
+        int32_t *run = state->run + word * WORD_BITS;
+        int32_t *best = state->best + word * WORD_BITS;
+        int32_t *best_end = state->best_end + word * WORD_BITS;
+
+        for (int bit = 0; bit < WORD_BITS; bit++) {
+            run[bit] = (bits >> bit) & 1 ? run[bit] + 1 : 0;
+            if (run[bit] > best[bit]) {
+                best[bit] = run[bit];
+                best_end[bit] = index;
+            }
+        }
+    }
+}
+
+#ifdef VLINE_X86
+/**
+ * Vertical line kernel for SSE2, 4 columns per instruction and 16 per iteration.
+ * @param state State of the search.
+ * @param row Packed row.
+ * @param index Index of the row.
+ */
+__attribute__((target ("sse2")))
+void vline_row_sse2 (VlineState *state, const uint64_t *row, int index) {
+    const __m128i select = _mm_setr_epi32 (1, 2, 4, 8);
+    const __m128i one = _mm_set1_epi32 (1);
+    const __m128i row_index = _mm_set1_epi32 (index);
+
+    for (size_t word = 0; word < state->stride; word++) {
+        uint64_t bits = row[word];
+
+        for (int part = 0; part < WORD_BITS; part += 16) {
+            for (int lane = 0; lane < 16; lane += 4) {
+                size_t col = word * WORD_BITS + part + lane;
+                __m128i mask = _mm_set1_epi32 ((int)((bits >> (part + lane)) & 0xf));
+                mask = _mm_cmpeq_epi32 (_mm_and_si128 (mask, select), select);
+
+                __m128i run = _mm_and_si128 (_mm_add_epi32 (_mm_load_si128 ((__m128i *)(state->run + col)), one), mask);
+                __m128i best = _mm_load_si128 ((__m128i *)(state->best + col));
+                __m128i best_end = _mm_load_si128 ((__m128i *)(state->best_end + col));
+                __m128i greater = _mm_cmpgt_epi32 (run, best);
+
+                _mm_store_si128 ((__m128i *)(state->run + col), run);
+                _mm_store_si128 ((__m128i *)(state->best + col), _mm_or_si128 (_mm_and_si128 (greater, run), _mm_andnot_si128 (greater, best)));
+                _mm_store_si128 ((__m128i *)(state->best_end + col), _mm_or_si128 (_mm_and_si128 (greater, row_index), _mm_andnot_si128 (greater, best_end)));
+            }
+        }
+    }
+}
+
+/**
+ * Vertical line kernel for AVX2, 8 columns per instruction and 32 per iteration.
+ * @param state State of the search.
+ * @param row Packed row.
+ * @param index Index of the row.
+ */
+__attribute__((target ("avx2")))
+void vline_row_avx2 (VlineState *state, const uint64_t *row, int index) {
+    const __m256i select = _mm256_setr_epi32 (1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i one = _mm256_set1_epi32 (1);
+    const __m256i row_index = _mm256_set1_epi32 (index);
+
+    for (size_t word = 0; word < state->stride; word++) {
+        uint64_t bits = row[word];
+
+        for (int part = 0; part < WORD_BITS; part += 32) {
+            for (int lane = 0; lane < 32; lane += 8) {
+                size_t col = word * WORD_BITS + part + lane;
+                __m256i mask = _mm256_set1_epi32 ((int)((bits >> (part + lane)) & 0xff));
+                mask = _mm256_cmpeq_epi32 (_mm256_and_si256 (mask, select), select);
+
+                __m256i run = _mm256_and_si256 (_mm256_add_epi32 (_mm256_load_si256 ((__m256i *)(state->run + col)), one), mask);
+                __m256i best = _mm256_load_si256 ((__m256i *)(state->best + col));
+                __m256i best_end = _mm256_load_si256 ((__m256i *)(state->best_end + col));
+                __m256i greater = _mm256_cmpgt_epi32 (run, best);
+
+                _mm256_store_si256 ((__m256i *)(state->run + col), run);
+                _mm256_store_si256 ((__m256i *)(state->best + col), _mm256_max_epi32 (best, run));
+                _mm256_store_si256 ((__m256i *)(state->best_end + col), _mm256_blendv_epi8 (best_end, row_index, greater));
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Function to pick the fastest vertical line kernel the processor supports.
+ * @return The kernel.
+ */
+VlineKernel vline_select_kernel (void) {
+#ifdef FIGSEARCH_BENCH
+    if (bench_kernel != NULL) {
+        return bench_kernel;
+    }
+#endif
+#ifdef VLINE_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        return vline_row_avx2;
+    }
+    if (__builtin_cpu_supports ("sse2")) {
+        return vline_row_sse2;
+    }
+#endif
+    return vline_row_scalar;
+}
+
+/**
+ * Function to prepare the vertical line search for rows of the given width.
+ * @param state State to initialize.
+ * @param num_cols Number of columns in the bitmap.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int vline_init (VlineState *state, int num_cols) {
+    state->num_cols = num_cols;
+    state->stride = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+    state->kernel = vline_select_kernel ();
+
+    // Counters are kept for whole words, so the kernels never need a tail loop.
+    size_t bytes = state->stride * WORD_BITS * sizeof(int32_t);
+    state->run = aligned_alloc (VECTOR_ALIGN, bytes);
+    state->best = aligned_alloc (VECTOR_ALIGN, bytes);
+    state->best_end = aligned_alloc (VECTOR_ALIGN, bytes);
+    if (state->run == NULL || state->best == NULL || state->best_end == NULL) {
+        vline_free (state);
+        return MEMORY_ERROR;
+    }
+
+    memset (state->run, 0, bytes);
+    memset (state->best, 0, bytes);
+    memset (state->best_end, 0, bytes);
+    return VALID;
+}
+
+/**
+ * Function to free the vertical line search.
+ * @param state State to free.
+ */
+void vline_free (VlineState *state) {
+    free (state->run);
+    free (state->best);
+    free (state->best_end);
+    state->run = NULL;
+    state->best = NULL;
+    state->best_end = NULL;
+}
+
+/**
+ * Function to pick the longest vertical line out of the per column results. Each column
+ * keeps its first longest run, so the columns only need to be compared by size and start.
+ * @param state State of the search.
+ * @param figure Pointer to store the line.
+ */
+void vline_result (const VlineState *state, Figure *figure) {
+    figure->size = 0;
+    for (int col = 0; col < state->num_cols; col++) {
+        int size = state->best[col];
+        int start = state->best_end[col] - size + 1;
+
+        if (size > 0 && figure_better (figure, size, start, col)) {
+            figure->size = size;
+            figure->start_x = start;
+            figure->start_y = col;
+            figure->end_x = state->best_end[col];
+            figure->end_y = col;
+        }
+    }
+}
+
+/**
+ * Work of one vertical line task: sweep all rows over its band of words.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *vline_task (void *argument) {
+    Task *task = argument;
+    const Bitmap *bitmap = task->bitmap;
+    int first_col = task->first * WORD_BITS;
+    int last_col = task->last * WORD_BITS < bitmap->num_cols ? task->last * WORD_BITS : bitmap->num_cols;
+    VlineState state;
+
+    if (vline_init (&state, last_col - first_col) != VALID) {
+        task->status = MEMORY_ERROR;
+        return NULL;
+    }
+
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        state.kernel (&state, bitmap_row (bitmap, index) + task->first, index);
+    }
+
+    vline_result (&state, &task->figure);
+    task->figure.start_y += first_col;
+    task->figure.end_y += first_col;
+    vline_free (&state);
+    return NULL;
+}
+
+/**
+ *  Function to find the longest vertical line in the bitmap. The rows are swept from
+ * top to bottom, updating a run counter and the longest run of every column at once.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads, each sweeping a band of columns.
+ * @param figure Pointer to store the line.
+ * @return Lenght of the longest vertical line found, -1 if there is a memory allocation failure.
+ */
+int find_vline (const Bitmap *bitmap, int jobs, Figure *figure) {
+    Task tasks[MAX_JOBS];
+    int count = task_count (jobs, (int)bitmap->stride);
+
+    // Bands are whole words, so the kernels of different threads never share a word.
+    split_bands (tasks, count, (int)bitmap->stride);
+    for (int index = 0; index < count; index++) {
+        tasks[index].bitmap = bitmap;
+    }
+    run_parallel (vline_task, tasks, sizeof(Task), count);
+
+    figure->size = 0;
+    for (int index = 0; index < count; index++) {
+        if (tasks[index].status != VALID) {
+            return -1;
+        }
+        figure_merge (figure, &tasks[index].figure);
+    }
+    return figure->size;
+}
+
+/**
+ * Function to get one word of a row shifted towards higher columns. Shifting row r by
+ * r bits (or by rows - 1 - r) shears the bitmap, so that every diagonal becomes a column.
+ * @param row Packed row.
+ * @param stride Number of words in the row.
+ * @param word Index of the word of the shifted row.
+ * @param shift Number of bits to shift by.
+ * @return The word of the shifted row.
+ */
+uint64_t shear_word (const uint64_t *row, size_t stride, size_t word, size_t shift) {
+    size_t words = shift / WORD_BITS;
+    int bits = (int)(shift % WORD_BITS);
+    uint64_t result = 0;
+
+    if (word >= words && word - words < stride) {
+        result = row[word - words] << bits;
+    }
+    if (bits != 0 && word >= words + 1 && word - words - 1 < stride) {
+        result |= row[word - words - 1] >> (WORD_BITS - bits);
+    }
+    return result;
+}
+
+/**
+ * Work of one thread of the diagonal line search: a band of words of the sheared
+ * bitmap. Each sheared row is built a word at a time and fed to the vertical line
+ * kernel, so 64 diagonals advance per word. Only the words a row covers are updated,
+ * the diagonals on either side of it have either ended or not started yet.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *dline_task (void *argument) {
+    Task *task = argument;
+    const Bitmap *bitmap = task->bitmap;
+    int num_rows = bitmap->num_rows;
+    int anti = task->anti;
+    uint64_t *sheared = malloc ((size_t)(task->last - task->first) * sizeof(uint64_t));
+    VlineState state;
+
+    if (sheared == NULL || vline_init (&state, (task->last - task->first) * WORD_BITS) != VALID) {
+        free (sheared);
+        task->status = MEMORY_ERROR;
+        return NULL;
+    }
+
+    for (int index = 0; index < num_rows; index++) {
+        size_t shift = anti ? (size_t)index : (size_t)(num_rows - 1 - index);
+        size_t low = shift / WORD_BITS > (size_t)task->first ? shift / WORD_BITS : (size_t)task->first;
+        size_t high = (shift + bitmap->num_cols - 1) / WORD_BITS + 1;
+
+        if (high > (size_t)task->last) {
+            high = task->last;
+        }
+        if (low >= high) {
+            continue;
+        }
+
+        for (size_t word = low; word < high; word++) {
+            sheared[word - low] = shear_word (bitmap_row (bitmap, index), bitmap->stride, word, shift);
+        }
+
+        VlineState view = state;
+        size_t offset = (low - task->first) * WORD_BITS;
+        view.stride = high - low;
+        view.run += offset;
+        view.best += offset;
+        view.best_end += offset;
+        view.kernel (&view, sheared, index);
+    }
+
+    // Column g of the sheared bitmap is the diagonal col - row = g - (rows - 1), or the
+    // anti-diagonal col + row = g; the start of a line is its top end.
+    for (int col = 0; col < state.num_cols; col++) {
+        int size = state.best[col];
+        int start_x = state.best_end[col] - size + 1;
+        int diagonal = task->first * WORD_BITS + col;
+        int start_y = anti ? diagonal - start_x : diagonal - (num_rows - 1) + start_x;
+
+        if (size > 0 && figure_better (&task->figure, size, start_x, start_y)) {
+            task->figure.size = size;
+            task->figure.start_x = start_x;
+            task->figure.start_y = start_y;
+            task->figure.end_x = state.best_end[col];
+            task->figure.end_y = anti ? start_y - size + 1 : start_y + size - 1;
+        }
+    }
+
+    free (sheared);
+    vline_free (&state);
+    return NULL;
+}
+
+/**
+ * Function to find the longest diagonal line going down and right, or with anti set
+ * the longest anti-diagonal line going down and left.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads.
+ * @param anti 1 for anti-diagonals, 0 for diagonals.
+ * @param figure Pointer to store the line, it starts at its top end.
+ * @return Length of the longest line found, -1 if there is a memory allocation failure.
+ */
+int find_dline (const Bitmap *bitmap, int jobs, int anti, Figure *figure) {
+    Task tasks[MAX_JOBS];
+    int width = (int)(((size_t)bitmap->num_rows + bitmap->num_cols - 1 + WORD_BITS - 1) / WORD_BITS);
+    int count = task_count (jobs, width);
+
+    split_bands (tasks, count, width);
+    for (int index = 0; index < count; index++) {
+        tasks[index].bitmap = bitmap;
+        tasks[index].anti = anti;
+    }
+    run_parallel (dline_task, tasks, sizeof(Task), count);
+
+    figure->size = 0;
+    for (int index = 0; index < count; index++) {
+        if (tasks[index].status != VALID) {
+            return -1;
+        }
+        figure_merge (figure, &tasks[index].figure);
+    }
+    return figure->size;
+}
+
+/**
+ * Function to validate the file and find the longest line while reading it row by row.
+ * Only one packed row and, for vline, the run counters of each column are kept in
+ * memory, so the bitmap itself may be larger than the available memory.
+ * @param filename Name of the text file, "-" for the standard input.
+ * @param operation Operation to perform (test, hline, vline).
+ * @param figure Pointer to store the line.
+ * @return VALID if the file is valid, 
+ *         INVALID_FILE if the file is invalid,
+ *         MEMORY_ERROR if there is a memory allocation failure.
+ */
+int stream_search (const char *filename, const char *operation, Figure *figure) {
+    Reader reader;
+    int num_rows, num_cols;
+    int vline = strcmp (operation, "vline") == 0;
+    int hline = strcmp (operation, "hline") == 0;
+    int phase = search_phase (operation);
+
+    if (reader_open (&reader, filename) != VALID) {
+        return INVALID_FILE;
+    }
+    if (read_header (&reader, &num_rows, &num_cols) != VALID) {
+        reader_close (&reader);
+        return INVALID_FILE;
+    }
+
+    size_t stride = ((size_t)num_cols + WORD_BITS - 1) / WORD_BITS;
+    uint64_t *row = malloc (stride * sizeof(uint64_t));
+    VlineState state = {0};
+    int status = VALID;
+
+    if (row == NULL || (vline && vline_init (&state, num_cols) != VALID)) {
+        status = MEMORY_ERROR;
+    }
+
+    // Parsing and searching alternate row by row, so with --stats each row is timed twice.
+    StatsClock clock;
+    figure->size = 0;
+    for (int index = 0; index < num_rows && status == VALID; index++) {
+        stats_start (&clock);
+        status = read_row (&reader, row, num_cols);
+        stats_stop (PHASE_PARSE, &clock);
+        if (status != VALID) {
+            break;
+        }
+
+        stats_start (&clock);
+        if (hline) {
+            hline_scan_row (figure, row, index, num_cols);
+        } else if (vline) {
+            state.kernel (&state, row, index);
+        }
+        stats_stop (phase, &clock);
+    }
+
+    if (status == VALID) {
+        stats_start (&clock);
+        status = reader_check_end (&reader);
+        stats_stop (PHASE_PARSE, &clock);
+        stats_add (&stats.pixels, (uint64_t)num_rows * (uint64_t)num_cols);
+    }
+    if (status == VALID && vline) {
+        stats_start (&clock);
+        vline_result (&state, figure);
+        stats_stop (phase, &clock);
+    }
+
+    free (row);
+    vline_free (&state);
+    reader_close (&reader);
+    return status;
+}
+
+/**
+ * Function to append a span to a list.
+ * @param list List of spans.
+ * @param first First column of the span.
+ * @param end Column after the last one.
+ * @param start Row where the span started.
+ * @return VALID if the span is appended, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int span_push (SpanList *list, int first, int end, int start) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        Span *items = realloc (list->items, capacity * sizeof(Span));
+        if (items == NULL) {
+            return MEMORY_ERROR;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = (Span){first, end, start};
+    return VALID;
+}
+
+/**
+ * Function to free the memory of a sparse bitmap.
+ * @param runs Pointer to the sparse bitmap.
+ */
+void runs_free (RunBitmap *runs) {
+    free (runs->offsets);
+    free (runs->runs.items);
+    runs->offsets = NULL;
+    runs->runs.items = NULL;
+}
+
+/**
+ * Function to find out whether a bitmap file is run-length encoded from its tag. Only
+ * regular files are looked at, reading a pipe would take the bitmap from its parser.
+ * The file is read directly, so the parse alone counts in the statistics.
+ * @param filename Name of the bitmap file.
+ * @return 1 if the file starts with the RLE tag, 0 otherwise.
+ */
+int is_rle_file (const char *filename) {
+    struct stat info;
+    char tag[4];
+    int fd = open (filename, O_RDONLY);
+    int rle = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat (fd, &info) == 0 && S_ISREG (info.st_mode) && pread (fd, tag, sizeof(tag), 0) == (ssize_t)sizeof(tag)) {
+        rle = memcmp (tag, "RLE", 3) == 0 && isspace ((unsigned char)tag[3]);
+    }
+    close (fd);
+    return rle;
+}
+
+/**
+ * Function to check a run-length encoded file and keep its runs. Touching runs are
+ * joined, so every run of a row is a maximal run of ones.
+ * @param filename Name of the bitmap file.
+ * @param runs Pointer to store the sparse bitmap.
+ * @return VALID if the file is valid,
+ *         INVALID_FILE if the file is invalid or not run-length encoded,
+ *         MEMORY_ERROR if there is a memory allocation failure.
+ */
+int runs_check (const char *filename, RunBitmap *runs) {
+    Reader reader;
+
+    if (reader_open (&reader, filename) != VALID) {
+        return INVALID_FILE;
+    }
+    if (read_header (&reader, &runs->num_rows, &runs->num_cols) != VALID || reader.format != FORMAT_RLE) {
+        reader_close (&reader);
+        return INVALID_FILE;
+    }
+
+    StatsClock clock;
+    stats_start (&clock);
+    runs->runs = (SpanList){0};
+    runs->offsets = malloc (((size_t)runs->num_rows + 1) * sizeof(size_t));
+    int status = runs->offsets != NULL ? VALID : MEMORY_ERROR;
+
+    for (int index = 0; index < runs->num_rows && status == VALID; index++) {
+        Span run = {0, 0, 0};
+        int count = 0;
+
+        runs->offsets[index] = runs->runs.count;
+        status = read_rle_count (&reader, runs->num_cols, &count);
+        for (int index2 = 0; index2 < count && status == VALID; index2++) {
+            status = read_rle_run (&reader, runs->num_cols, &run);
+            if (status != VALID) {
+                break;
+            }
+
+            SpanList *list = &runs->runs;
+            if (list->count > runs->offsets[index] && list->items[list->count - 1].end == run.first) {
+                list->items[list->count - 1].end = run.end;
+            } else {
+                status = span_push (list, run.first, run.end, 0);
+            }
+        }
+    }
+    if (status == VALID) {
+        runs->offsets[runs->num_rows] = runs->runs.count;
+        status = reader_check_end (&reader);
+    }
+    stats_stop (PHASE_PARSE, &clock);
+    stats_add (&stats.pixels, (uint64_t)runs->num_rows * (uint64_t)runs->num_cols);
+
+    reader_close (&reader);
+    if (status != VALID) {
+        runs_free (runs);
+    }
+    return status;
+}
+
+/**
+ * Function to find the longest horizontal line of a sparse bitmap, it is its longest run.
+ * @param runs Sparse bitmap.
+ * @param figure Pointer to store the line.
+ */
+void runs_hline (const RunBitmap *runs, Figure *figure) {
+    figure->size = 0;
+    for (int index = 0; index < runs->num_rows; index++) {
+        for (size_t run = runs->offsets[index]; run < runs->offsets[index + 1]; run++) {
+            const Span *span = &runs->runs.items[run];
+
+            if (figure_better (figure, span->end - span->first, index, span->first)) {
+                figure->size = span->end - span->first;
+                figure->start_x = index;
+                figure->start_y = span->first;
+                figure->end_x = index;
+                figure->end_y = span->end - 1;
+            }
+        }
+    }
+}
+
+/**
+ * Function to sweep the rows of a sparse bitmap and follow the vertical runs of ones.
+ * The columns under a run of ones are kept as spans grouped by the row their vertical
+ * run started in; every row splits them against its runs, so the work per row is
+ * proportional to the number of runs and spans, not to the number of columns.
+ * @param runs Sparse bitmap.
+ * @param figure Pointer to store the longest vertical line.
+ * @param ended If not NULL, every vertical run is appended as a span of rows
+ * [first, end) with its column in start.
+ * @return VALID if the sweep is complete, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int runs_sweep (const RunBitmap *runs, Figure *figure, SpanList *ended) {
+    SpanList active = {0}, next = {0};
+    int status = VALID;
+
+    figure->size = 0;
+    // The row after the last one has no runs and ends every vertical run left.
+    for (int index = 0; index <= runs->num_rows && status == VALID; index++) {
+        const Span *row = index < runs->num_rows ? runs->runs.items + runs->offsets[index] : NULL;
+        size_t count = index < runs->num_rows ? runs->offsets[index + 1] - runs->offsets[index] : 0;
+        size_t low = 0;
+
+        // Parts of the active spans not under a run of this row end in the row above.
+        for (size_t span = 0; span < active.count && status == VALID; span++) {
+            const Span *columns = &active.items[span];
+            int col = columns->first;
+
+            while (low < count && row[low].end <= col) {
+                low++;
+            }
+            for (size_t run = low; col < columns->end; run++) {
+                int end = run < count && row[run].first < columns->end ? row[run].first : columns->end;
+
+                if (col < end) {
+                    if (figure_better (figure, index - columns->start, columns->start, col)) {
+                        figure->size = index - columns->start;
+                        figure->start_x = columns->start;
+                        figure->start_y = col;
+                        figure->end_x = index - 1;
+                        figure->end_y = col;
+                    }
+                    for (int col2 = col; col2 < end && ended != NULL && status == VALID; col2++) {
+                        status = span_push (ended, columns->start, index, col2);
+                    }
+                }
+                if (run >= count || row[run].first >= columns->end) {
+                    break;
+                }
+                col = row[run].end;
+            }
+        }
+
+        // The runs of this row continue the active spans above them and start new ones
+        // elsewhere; neighbours that started in the same row are joined.
+        next.count = 0;
+        low = 0;
+        for (size_t run = 0; run < count && status == VALID; run++) {
+            int col = row[run].first;
+
+            while (low < active.count && active.items[low].end <= col) {
+                low++;
+            }
+            while (col < row[run].end && status == VALID) {
+                const Span *columns = low < active.count && active.items[low].first < row[run].end ? &active.items[low] : NULL;
+                int end = columns == NULL ? row[run].end : (columns->first > col ? columns->first : (columns->end < row[run].end ? columns->end : row[run].end));
+                int start = columns != NULL && columns->first <= col ? columns->start : index;
+
+                if (next.count > 0 && next.items[next.count - 1].end == col && next.items[next.count - 1].start == start) {
+                    next.items[next.count - 1].end = end;
+                } else {
+                    status = span_push (&next, col, end, start);
+                }
+                if (columns != NULL && columns->end <= end) {
+                    low++;
+                }
+                col = end;
+            }
+        }
+
+        SpanList swap = active;
+        active = next;
+        next = swap;
+    }
+
+    free (active.items);
+    free (next.items);
+    return status;
+}
+
+/**
+ * Function to find the length of the run of ones starting at a position, looking it up
+ * among sorted spans with a binary search.
+ * @param spans Sorted spans that do not overlap.
+ * @param count Number of spans.
+ * @param position Position of the first pixel.
+ * @return Length of the run from the position, 0 if the pixel is not set.
+ */
+int span_run (const Span *spans, size_t count, int position) {
+    size_t low = 0, high = count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (spans[middle].first <= position) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 && spans[low - 1].end > position ? spans[low - 1].end - position : 0;
+}
+
+/**
+ * Function to find the largest square of a sparse bitmap. The vertical runs from the
+ * sweep are sorted by column, so the four edges of a square are checked with binary
+ * searches in the runs of its rows and columns, and only set pixels are visited.
+ * @param runs Sparse bitmap.
+ * @param figure Pointer to store the square.
+ * @return VALID if the search is complete, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int runs_square (const RunBitmap *runs, Figure *figure) {
+    SpanList ended = {0};
+    Figure line;
+    int num_cols = runs->num_cols;
+    size_t *offsets = calloc ((size_t)num_cols + 1, sizeof(size_t));
+    Span *columns = NULL;
+    int status = offsets != NULL ? runs_sweep (runs, &line, &ended) : MEMORY_ERROR;
+
+    // Counting sort by column keeps the vertical runs of a column ordered by row.
+    if (status == VALID && ended.count > 0) {
+        columns = malloc (ended.count * sizeof(Span));
+        status = columns != NULL ? VALID : MEMORY_ERROR;
+    }
+    if (status == VALID) {
+        for (size_t index = 0; index < ended.count; index++) {
+            offsets[ended.items[index].start + 1]++;
+        }
+        for (int col = 0; col < num_cols; col++) {
+            offsets[col + 1] += offsets[col];
+        }
+        for (size_t index = 0; index < ended.count; index++) {
+            columns[offsets[ended.items[index].start]++] = ended.items[index];
+        }
+        for (int col = num_cols; col > 0; col--) {
+            offsets[col] = offsets[col - 1];
+        }
+        offsets[0] = 0;
+    }
+    free (ended.items);
+
+    uint64_t candidates = 0;
+    figure->size = 0;
+    for (int index = 0; status == VALID && index < runs->num_rows && runs->num_rows - index > figure->size; index++) {
+        for (size_t run = runs->offsets[index]; run < runs->offsets[index + 1]; run++) {
+            const Span *span = &runs->runs.items[run];
+
+            // Corners in a later row or column only win with a strictly larger square.
+            for (int col = span->first; col < span->end && span->end - col > figure->size; col++) {
+                int down = span_run (columns + offsets[col], offsets[col + 1] - offsets[col], index);
+                int limit = span->end - col < down ? span->end - col : down;
+
+                for (int size = limit; size > figure->size; size--) {
+                    int bottom = index + size - 1;
+                    int right = col + size - 1;
+                    const Span *bottom_row = runs->runs.items + runs->offsets[bottom];
+
+                    candidates++;
+                    if (span_run (bottom_row, runs->offsets[bottom + 1] - runs->offsets[bottom], col) >= size
+                            && span_run (columns + offsets[right], offsets[right + 1] - offsets[right], index) >= size) {
+                        figure->size = size;
+                        figure->start_x = index;
+                        figure->start_y = col;
+                        figure->end_x = bottom;
+                        figure->end_y = right;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    stats_add (&stats.candidates, candidates);
+    free (offsets);
+    free (columns);
+    return status;
+}
+
+/**
+ * Function to run a line or square search on a run-length encoded file without
+ * expanding it into a bitmap.
+ * @param filename Name of the bitmap file.
+ * @param operation Operation to perform (hline, vline, square).
+ * @param figure Pointer to store the figure.
+ * @return Status code indicating the result of the operation.
+ */
+int sparse_search (const char *filename, const char *operation, Figure *figure) {
+    RunBitmap runs;
+    int status = runs_check (filename, &runs);
+
+    if (status != VALID) {
+        return status;
+    }
+
+    StatsClock clock;
+    stats_start (&clock);
+    if (strcmp (operation, "hline") == 0) {
+        runs_hline (&runs, figure);
+    } else if (strcmp (operation, "vline") == 0) {
+        status = runs_sweep (&runs, figure, NULL);
+    } else {
+        status = runs_square (&runs, figure);
+    }
+    stats_stop (search_phase (operation), &clock);
+
+    runs_free (&runs);
+    return status;
+}
+
+/**
+ * Work of the first table pass: the right runs and the down runs of a band of rows,
+ * the down runs counted only up to the bottom of the band.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *tables_task (void *argument) {
+    Task *task = argument;
+    int num_cols = task->bitmap->num_cols;
+
+    // Bottom up, so the down runs of the row below are already known.
+    for (int index = task->last - 1; index >= task->first; index--) {
+        const uint64_t *row = bitmap_row (task->bitmap, index);
+        int *right_row = task->tables->right + (size_t)index * num_cols;
+        int *down_row = task->tables->down + (size_t)index * num_cols;
+        const int *down_below = index + 1 < task->last ? down_row + num_cols : NULL;
+        int col = 0;
+
+        while ((col = next_one (row, col, num_cols)) < num_cols) {
+            int run_end = next_zero (row, col, num_cols);
+            for (int index2 = col; index2 < run_end; index2++) {
+                right_row[index2] = run_end - index2;
+                down_row[index2] = (down_below != NULL ? down_below[index2] : 0) + 1;
+            }
+            col = run_end;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Work of the seam pass: extend the down runs reaching the bottom of the band by the
+ * run continuing in the bands below.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *seam_task (void *argument) {
+    Task *task = argument;
+    int num_cols = task->bitmap->num_cols;
+
+    for (int col = 0; col < num_cols; col++) {
+        if (task->carry[col] == 0) {
+            continue;
+        }
+        for (int index = task->last - 1; index >= task->first; index--) {
+            int *down = &task->tables->down[(size_t)index * num_cols + col];
+            if (*down != task->last - index) {
+                break;
+            }
+            *down += task->carry[col];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function to build the run length tables of the bitmap. With more threads each builds
+ * the tables of a band of rows, and the down runs crossing the seams between bands are
+ * joined afterwards.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads.
+ * @param tables Pointer to store the tables.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int run_tables_build (const Bitmap *bitmap, int jobs, RunTables *tables) {
+    int num_rows = bitmap->num_rows;
+    int num_cols = bitmap->num_cols;
+    Task tasks[MAX_JOBS];
+    int count = task_count (jobs, num_rows);
+    int *carry = NULL;
+
+    tables->right = calloc ((size_t)num_rows * num_cols, sizeof(int));
+    tables->down = calloc ((size_t)num_rows * num_cols, sizeof(int));
+    if (count > 1) {
+        carry = calloc ((size_t)count * num_cols, sizeof(int));
+    }
+    if (tables->right == NULL || tables->down == NULL || (count > 1 && carry == NULL)) {
+        run_tables_free (tables);
+        return MEMORY_ERROR;
+    }
+
+    split_bands (tasks, count, num_rows);
+    for (int index = 0; index < count; index++) {
+        tasks[index].bitmap = bitmap;
+        tasks[index].tables = tables;
+        tasks[index].carry = carry + (size_t)index * num_cols;
+    }
+    run_parallel (tables_task, tasks, sizeof(Task), count);
+
+    if (count > 1) {
+        // The run continuing below each band, from the lowest seam up. The last band
+        // has nothing below it and keeps a zero carry.
+        for (int index = count - 2; index >= 0; index--) {
+            const int *next_down = tables->down + (size_t)tasks[index + 1].first * num_cols;
+            const int *next_carry = tasks[index + 1].carry;
+            int next_height = tasks[index + 1].last - tasks[index + 1].first;
+
+            for (int col = 0; col < num_cols; col++) {
+                tasks[index].carry[col] = next_down[col] + (next_down[col] == next_height ? next_carry[col] : 0);
+            }
+        }
+        run_parallel (seam_task, tasks, sizeof(Task), count - 1);
+    }
+
+    free (carry);
+    return VALID;
+}
+
+/**
+ * Function to free the run length tables.
+ * @param tables Tables to free.
+ */
+void run_tables_free (RunTables *tables) {
+    free (tables->right);
+    free (tables->down);
+    tables->right = NULL;
+    tables->down = NULL;
+}
+
+/**
+ * Work of one square task: search the corners in its band of rows. Sizes smaller than
+ * the best one any task has found cannot win and are skipped.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *square_task (void *argument) {
+    Task *task = argument;
+    const Bitmap *bitmap = task->bitmap;
+    const RunTables *tables = task->tables;
+    int num_rows = bitmap->num_rows;
+    int num_cols = bitmap->num_cols;
+    int maximum_size = 0;
+    uint64_t candidates = 0;
+
+    // A corner in a later row can only win with a strictly larger square, so rows
+    // that cannot fit one are not visited at all.
+    for (int index = task->first; index < task->last && num_rows - index > maximum_size; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        const int *right_row = tables->right + (size_t)index * num_cols;
+        const int *down_row = tables->down + (size_t)index * num_cols;
+        int shared = atomic_load_explicit (task->shared_size, memory_order_relaxed);
+        int bound = maximum_size > shared - 1 ? maximum_size : shared - 1;
+        int index2 = 0;
+
+        while ((index2 = next_one (row, index2, num_cols)) < num_cols) {
+            // The right run only shrinks along a run, so its tail can be skipped as a whole.
+            if (right_row[index2] <= bound) {
+                index2 += right_row[index2];
+                continue;
+            }
+
+            int limit = right_row[index2] < down_row[index2] ? right_row[index2] : down_row[index2];
+
+            // Largest size first; the top and left edges are covered by the limit, the
+            // bottom and right edges are one table lookup each.
+            for (int size = limit; size > bound; size--) {
+                int bottom = index + size - 1;
+                int right = index2 + size - 1;
+
+                candidates++;
+                if (tables->right[(size_t)bottom * num_cols + index2] >= size && down_row[right] >= size) {
+                    maximum_size = size;
+                    bound = size;
+                    task->figure.size = size;
+                    task->figure.start_x = index;
+                    task->figure.start_y = index2;
+                    task->figure.end_x = bottom;
+                    task->figure.end_y = right;
+
+                    int seen = atomic_load_explicit (task->shared_size, memory_order_relaxed);
+                    while (seen < size && !atomic_compare_exchange_weak (task->shared_size, &seen, size)) {
+                    }
+                }
+            }
+            index2++;
+        }
+    }
+    stats_add (&stats.candidates, candidates);
+    return NULL;
+}
+
+/**
+ * Function to search the corners of squares using run length tables that are already built.
+ * @param bitmap Packed bitmap.
+ * @param tables Run length tables of the bitmap.
+ * @param jobs Number of threads, each searching the corners in a band of rows.
+ * @param figure Pointer to store the square.
+ * @return Size of the largest square found.
+ */
+int square_search (const Bitmap *bitmap, RunTables *tables, int jobs, Figure *figure) {
+    Task tasks[MAX_JOBS];
+    atomic_int shared_size = 0;
+    int count = task_count (jobs, bitmap->num_rows);
+
+    split_bands (tasks, count, bitmap->num_rows);
+    for (int index = 0; index < count; index++) {
+        tasks[index].bitmap = bitmap;
+        tasks[index].tables = tables;
+        tasks[index].shared_size = &shared_size;
+    }
+    run_parallel (square_task, tasks, sizeof(Task), count);
+
+    figure->size = 0;
+    for (int index = 0; index < count; index++) {
+        figure_merge (figure, &tasks[index].figure);
+    }
+    return figure->size;
+}
+
+/**
+ *  Function to find the largest square in the bitmap.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads, each searching the corners in a band of rows.
+ * @param figure Pointer to store the square.
+ * @return Size of the largest square found, -1 if there is a memory allocation failure.
+ */
+int find_square (const Bitmap *bitmap, int jobs, Figure *figure) {
+    RunTables tables;
+
+    if (run_tables_build (bitmap, jobs, &tables) != VALID) {
+        return -1;
+    }
+
+    square_search (bitmap, &tables, jobs, figure);
+    run_tables_free (&tables);
+    return figure->size;  
+}
+
+/**
+ * Function to find the largest rectangle filled with ones. Every row is the base of a
+ * histogram of the runs of ones going up, and a monotonic stack yields each maximal
+ * rectangle standing on that row, so the whole search is O(N.M).
+ * Rectangles of the same area are ordered by the starting row, the starting column and
+ * then the ending row, so the wider one wins among those sharing a corner.
+ * @param bitmap Packed bitmap.
+ * @param figure Pointer to store the rectangle, its size is the area.
+ * @return Area of the largest rectangle found, -1 if there is a memory allocation failure.
+ */
+long long find_rect (const Bitmap *bitmap, Figure *figure) {
+    int num_cols = bitmap->num_cols;
+    int *heights = calloc (num_cols + 1, sizeof(int));
+    int *stack = malloc ((num_cols + 1) * sizeof(int));
+    long long best_area = 0;
+
+    figure->size = 0;
+    if (heights == NULL || stack == NULL) {
+        free (heights);
+        free (stack);
+        return -1;
+    }
+
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        int top = 0;
+
+        for (int col = 0; col < num_cols; col++) {
+            heights[col] = (row[col / WORD_BITS] >> (col % WORD_BITS)) & 1 ? heights[col] + 1 : 0;
+        }
+
+        // heights[num_cols] stays 0 and closes every bar left on the stack.
+        for (int col = 0; col <= num_cols; col++) {
+            while (top > 0 && heights[stack[top - 1]] >= heights[col]) {
+                int height = heights[stack[--top]];
+                int left = top > 0 ? stack[top - 1] + 1 : 0;
+                long long area = (long long)height * (col - left);
+                int start_x = index - height + 1;
+
+                if (height > 0 && (area > best_area || (area == best_area && (start_x < figure->start_x || (start_x == figure->start_x
+                        && (left < figure->start_y || (left == figure->start_y && index < figure->end_x))))))) {
+                    best_area = area;
+                    figure->size = area > INT_MAX ? INT_MAX : (int)area;
+                    figure->start_x = start_x;
+                    figure->start_y = left;
+                    figure->end_x = index;
+                    figure->end_y = col - 1;
+                }
+            }
+            stack[top++] = col;
+        }
+    }
+
+    free (heights);
+    free (stack);
+    return best_area;
+}
+
+/**
+ * Function to find the largest square filled with ones. For every pixel the size of the
+ * largest filled square ending there follows from its three neighbours above and to the
+ * left, so only the previous row of sizes is kept.
+ * @param bitmap Packed bitmap.
+ * @param figure Pointer to store the square.
+ * @return Size of the largest filled square found, -1 if there is a memory allocation failure.
+ */
+int find_fsquare (const Bitmap *bitmap, Figure *figure) {
+    int num_cols = bitmap->num_cols;
+    int *previous = calloc (num_cols, sizeof(int));
+    int *current = calloc (num_cols, sizeof(int));
+
+    figure->size = 0;
+    if (previous == NULL || current == NULL) {
+        free (previous);
+        free (current);
+        return -1;
+    }
+
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+
+        for (int col = 0; col < num_cols; col++) {
+            if (!((row[col / WORD_BITS] >> (col % WORD_BITS)) & 1)) {
+                current[col] = 0;
+                continue;
+            }
+
+            int size = 1;
+            if (col > 0) {
+                size = previous[col] < current[col - 1] ? previous[col] : current[col - 1];
+                size = (previous[col - 1] < size ? previous[col - 1] : size) + 1;
+            }
+            current[col] = size;
+
+            if (figure_better (figure, size, index - size + 1, col - size + 1)) {
+                figure->size = size;
+                figure->start_x = index - size + 1;
+                figure->start_y = col - size + 1;
+                figure->end_x = index;
+                figure->end_y = col;
+            }
+        }
+
+        int *swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    free (previous);
+    free (current);
+    return figure->size;
+}
+
+/**
+ * Function to compare two figures in the order they are printed in: larger first,
+ * then by the starting row and column.
+ * @param first First figure.
+ * @param second Second figure.
+ * @return Negative, zero or positive, as for qsort.
+ */
+int figure_compare (const void *first, const void *second) {
+    const Figure *one = first;
+    const Figure *two = second;
+
+    if (one->size != two->size) {
+        return one->size > two->size ? -1 : 1;
+    }
+    if (one->start_x != two->start_x) {
+        return one->start_x < two->start_x ? -1 : 1;
+    }
+    return (one->start_y > two->start_y) - (one->start_y < two->start_y);
+}
+
+/**
+ * Function to check whether a figure would be kept by the list. Sizes only shrink while
+ * the corners of a square are tried, so a refused size ends the search at that corner.
+ * @param list The list.
+ * @param size Size of the figure.
+ * @param start_x Starting x-coordinate of the figure.
+ * @param start_y Starting y-coordinate of the figure.
+ * @return 1 if the figure would be kept, 0 otherwise.
+ */
+int figure_list_accepts (const FigureList *list, int size, int start_x, int start_y) {
+    if (list->ties) {
+        return list->count == 0 || size >= list->items[0].size;
+    }
+    return list->count < list->limit || figure_better (&list->items[0], size, start_x, start_y);
+}
+
+/**
+ * Function to restore the heap of the list below the given item. The root of the heap
+ * is the worst figure kept, the one to drop when a better figure comes.
+ * @param list The list.
+ * @param index Index of the item that may be better than its children.
+ */
+void figure_list_sift (FigureList *list, int index) {
+    for (;;) {
+        int worst = index;
+        for (int child = 2 * index + 1; child <= 2 * index + 2 && child < list->count; child++) {
+            if (figure_better (&list->items[child], list->items[worst].size, list->items[worst].start_x, list->items[worst].start_y)) {
+                worst = child;
+            }
+        }
+        if (worst == index) {
+            return;
+        }
+
+        Figure swap = list->items[index];
+        list->items[index] = list->items[worst];
+        list->items[worst] = swap;
+        index = worst;
+    }
+}
+
+/**
+ * Function to offer a figure to the list. In the top K mode the list is a heap of at most
+ * K figures, in the ties mode it holds all figures of the largest size seen so far.
+ * @param list The list.
+ * @param figure The figure.
+ */
+void figure_list_add (FigureList *list, const Figure *figure) {
+    if (!figure_list_accepts (list, figure->size, figure->start_x, figure->start_y)) {
+        return;
+    }
+
+    if (list->ties && list->count > 0 && figure->size > list->items[0].size) {
+        list->count = 0;
+    }
+
+    // The heap is full, the new figure takes the place of the worst one.
+    if (!list->ties && list->count == list->limit) {
+        list->items[0] = *figure;
+        figure_list_sift (list, 0);
+        return;
+    }
+
+    if (list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? 2 * list->capacity : 64;
+        Figure *items = realloc (list->items, capacity * sizeof(Figure));
+        if (items == NULL) {
+            list->status = MEMORY_ERROR;
+            return;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    // Sift the new figure up while it is worse than its parent.
+    int index = list->count++;
+    while (!list->ties && index > 0) {
+        int parent = (index - 1) / 2;
+        if (!figure_better (figure, list->items[parent].size, list->items[parent].start_x, list->items[parent].start_y)) {
+            break;
+        }
+        list->items[index] = list->items[parent];
+        index = parent;
+    }
+    list->items[index] = *figure;
+}
+
+/**
+ * Function to collect every horizontal line, that is every run of a row.
+ * @param bitmap Packed bitmap.
+ * @param list List to collect the lines into.
+ */
+void find_hlines (const Bitmap *bitmap, FigureList *list) {
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        int col = 0;
+
+        while ((col = next_one (row, col, bitmap->num_cols)) < bitmap->num_cols) {
+            int run_end = next_zero (row, col, bitmap->num_cols);
+            Figure line = { run_end - col, index, col, index, run_end - 1 };
+
+            figure_list_add (list, &line);
+            col = run_end;
+        }
+    }
+}
+
+/**
+ * Function to collect every vertical line. The rows are compared word by word and only
+ * the columns where a run starts or ends cost any work.
+ * @param bitmap Packed bitmap.
+ * @param list List to collect the lines into.
+ */
+void find_vlines (const Bitmap *bitmap, FigureList *list) {
+    // Row where the run currently open in each column started.
+    int *run_start = malloc (bitmap->num_cols * sizeof(int));
+    if (run_start == NULL) {
+        list->status = MEMORY_ERROR;
+        return;
+    }
+
+    // One extra sweep with an empty row closes the runs reaching the last row.
+    for (int index = 0; index <= bitmap->num_rows; index++) {
+        for (size_t word = 0; word < bitmap->stride; word++) {
+            uint64_t before = index > 0 ? bitmap_row (bitmap, index - 1)[word] : 0;
+            uint64_t now = index < bitmap->num_rows ? bitmap_row (bitmap, index)[word] : 0;
+            uint64_t ended = before & ~now;
+            uint64_t started = now & ~before;
+
+            while (ended != 0) {
+                int col = (int)(word * WORD_BITS) + CTZ (ended);
+                Figure line = { index - run_start[col], run_start[col], col, index - 1, col };
+
+                figure_list_add (list, &line);
+                ended &= ended - 1;
+            }
+            while (started != 0) {
+                run_start[(int)(word * WORD_BITS) + CTZ (started)] = index;
+                started &= started - 1;
+            }
+        }
+    }
+    free (run_start);
+}
+
+/**
+ * Function to collect the squares, every corner with every size that fits there.
+ * @param bitmap Packed bitmap.
+ * @param jobs Number of threads building the run length tables.
+ * @param list List to collect the squares into.
+ */
+void find_squares (const Bitmap *bitmap, int jobs, FigureList *list) {
+    int num_cols = bitmap->num_cols;
+    RunTables tables;
+
+    if (run_tables_build (bitmap, jobs, &tables) != VALID) {
+        list->status = MEMORY_ERROR;
+        return;
+    }
+
+    uint64_t candidates = 0;
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        const int *right_row = tables.right + (size_t)index * num_cols;
+        const int *down_row = tables.down + (size_t)index * num_cols;
+        int index2 = 0;
+
+        while ((index2 = next_one (row, index2, num_cols)) < num_cols) {
+            int limit = right_row[index2] < down_row[index2] ? right_row[index2] : down_row[index2];
+
+            for (int size = limit; size > 0 && figure_list_accepts (list, size, index, index2); size--) {
+                int bottom = index + size - 1;
+                int right = index2 + size - 1;
+
+                candidates++;
+                if (tables.right[(size_t)bottom * num_cols + index2] >= size && down_row[right] >= size) {
+                    Figure square = { size, index, index2, bottom, right };
+                    figure_list_add (list, &square);
+                }
+            }
+            index2++;
+        }
+    }
+    stats_add (&stats.candidates, candidates);
+    run_tables_free (&tables);
+}
+
+/**
+ * Function to find the K largest figures, or all figures tied for the largest size, and
+ * print them from the largest, ties by the starting row and column.
+ * @param bitmap Packed bitmap.
+ * @param operation Operation to perform (hline, vline, square).
+ * @param options Command line options giving K or the ties mode.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int run_ranking (const Bitmap *bitmap, const char *operation, const Options *options) {
+    FigureList list = { NULL, 0, 0, options->top, options->ties, VALID };
+    Figure none = {0};
+    StatsClock clock;
+
+    stats_start (&clock);
+    if (strcmp (operation, "hline") == 0) {
+        find_hlines (bitmap, &list);
+    } else if (strcmp (operation, "vline") == 0) {
+        find_vlines (bitmap, &list);
+    } else if (strcmp (operation, "square") == 0) {
+        find_squares (bitmap, options->jobs, &list);
+    }
+    stats_stop (search_phase (operation), &clock);
+
+    if (list.status == VALID) {
+        qsort (list.items, list.count, sizeof(Figure), figure_compare);
+        for (int index = 0; index < list.count; index++) {
+            print_figure (stdout, operation, &list.items[index]);
+        }
+        if (list.count == 0 && strcmp (operation, "test") != 0) {
+            print_figure (stdout, operation, &none);
+        }
+    }
+
+    free (list.items);
+    return list.status;
+}
+
+/**
+ * Function to find the longest vertical run of one column, the first one on a tie.
+ * @param bitmap Packed bitmap.
+ * @param col Index of the column.
+ * @param best Pointer to store the length of the run.
+ * @param best_end Pointer to store the row where the run ends.
+ */
+void column_best (const Bitmap *bitmap, int col, int32_t *best, int32_t *best_end) {
+    int run = 0;
+
+    *best = 0;
+    *best_end = 0;
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        run = bitmap_get (bitmap, index, col) ? run + 1 : 0;
+        if (run > *best) {
+            *best = run;
+            *best_end = index;
+        }
+    }
+}
+
+/**
+ * Function to load the structures the daemon answers its queries from: the longest
+ * run of every row and column and the run length tables.
+ * @param daemon The daemon, its bitmap already loaded.
+ * @param jobs Number of threads for the first build of the structures.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int daemon_init (Daemon *daemon, int jobs) {
+    const Bitmap *bitmap = &daemon->bitmap;
+
+    // Everything daemon_free may see is empty until it is allocated.
+    daemon->columns = (VlineState){0};
+    daemon->tables = (RunTables){0};
+    daemon->row_best = malloc (bitmap->num_rows * sizeof(Figure));
+    daemon->square_dirty = 1;
+    if (daemon->row_best == NULL || vline_init (&daemon->columns, bitmap->num_cols) != VALID || run_tables_build (bitmap, jobs, &daemon->tables) != VALID) {
+        daemon_free (daemon);
+        return MEMORY_ERROR;
+    }
+
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        daemon->row_best[index].size = 0;
+        hline_scan_row (&daemon->row_best[index], bitmap_row (bitmap, index), index, bitmap->num_cols);
+    }
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        daemon->columns.kernel (&daemon->columns, bitmap_row (bitmap, index), index);
+    }
+    return VALID;
+}
+
+/**
+ * Function to free the structures of the daemon, the bitmap is left alone.
+ * @param daemon The daemon.
+ */
+void daemon_free (Daemon *daemon) {
+    free (daemon->row_best);
+    daemon->row_best = NULL;
+    if (daemon->columns.run != NULL) {
+        vline_free (&daemon->columns);
+    }
+    run_tables_free (&daemon->tables);
+}
+
+/**
+ * Function to change one pixel and update everything that depends on it: the row and the
+ * column of the pixel, the right runs of its row and the down runs above it in its column.
+ * @param daemon The daemon.
+ * @param row Index of the row.
+ * @param col Index of the column.
+ * @param value New value of the pixel.
+ */
+void daemon_set (Daemon *daemon, int row, int col, int value) {
+    Bitmap *bitmap = &daemon->bitmap;
+    int num_cols = bitmap->num_cols;
+    uint64_t *word = &bitmap_row (bitmap, row)[col / WORD_BITS];
+
+    if (bitmap_get (bitmap, row, col) == value) {
+        return;
+    }
+    *word ^= (uint64_t)1 << (col % WORD_BITS);
+    daemon->square_dirty = 1;
+
+    daemon->row_best[row].size = 0;
+    hline_scan_row (&daemon->row_best[row], bitmap_row (bitmap, row), row, num_cols);
+    column_best (bitmap, col, &daemon->columns.best[col], &daemon->columns.best_end[col]);
+
+    // Right runs of the row, from the right so each pixel extends its neighbour's run.
+    int *right_row = daemon->tables.right + (size_t)row * num_cols;
+    for (int index = num_cols - 1; index >= 0; index--) {
+        right_row[index] = bitmap_get (bitmap, row, index) ? (index + 1 < num_cols ? right_row[index + 1] : 0) + 1 : 0;
+    }
+
+    // Down runs of the column, upwards until a run length stays the same.
+    for (int index = row; index >= 0; index--) {
+        int *down = &daemon->tables.down[(size_t)index * num_cols + col];
+        int below = index + 1 < bitmap->num_rows ? down[num_cols] : 0;
+        int updated = bitmap_get (bitmap, index, col) ? below + 1 : 0;
+
+        if (index < row && updated == *down) {
+            break;
+        }
+        *down = updated;
+    }
+}
+
+/**
+ * Function to answer a query of the daemon. Lines are picked out of the kept per row and
+ * per column results. The square is not kept up to date: set only marks it stale and the
+ * first square query after a change searches the whole bitmap again on the kept tables,
+ * so an update costs O(rows + cols) and the next square query a full search.
+ * @param daemon The daemon.
+ * @param operation The query (hline, vline, square).
+ * @param jobs Number of threads for the square search.
+ * @param figure Pointer to store the figure.
+ */
+void daemon_query (Daemon *daemon, const char *operation, int jobs, Figure *figure) {
+    figure->size = 0;
+    if (strcmp (operation, "hline") == 0) {
+        for (int index = 0; index < daemon->bitmap.num_rows; index++) {
+            figure_merge (figure, &daemon->row_best[index]);
+        }
+    } else if (strcmp (operation, "vline") == 0) {
+        vline_result (&daemon->columns, figure);
+    } else {
+        if (daemon->square_dirty) {
+            square_search (&daemon->bitmap, &daemon->tables, jobs, &daemon->square);
+            daemon->square_dirty = 0;
+        }
+        *figure = daemon->square;
+    }
+}
+
+/**
+ * Function to run the daemon: keep the bitmap in memory and read commands from the
+ * standard input until its end or quit. "set <row> <col> <0|1>" changes a pixel, hline,
+ * vline and square print the figure as the operations do. Lines are updated with every
+ * set, the square is searched again in full on the first query after a change, so
+ * streams that mix updates and square queries pay a full search per query. Blank
+ * lines are skipped, malformed and unknown commands print "Invalid command".
+ * @param bitmap The loaded bitmap, the daemon changes it in place.
+ * @param options Command line options.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int run_daemon (Bitmap *bitmap, const Options *options) {
+    Daemon daemon;
+    Figure figure;
+    char *line = NULL;
+    size_t size = 0;
+
+    daemon.bitmap = *bitmap;
+    if (daemon_init (&daemon, options->jobs) != VALID) {
+        return MEMORY_ERROR;
+    }
+
+    while (getline (&line, &size, stdin) >= 0) {
+        char command[8], extra;
+        int row, col, value;
+        if (is_blank_line (line)) {
+            continue;
+        }
+        int fields = sscanf (line, "%7s %d %d %d %c", command, &row, &col, &value, &extra);
+
+        if (fields == 1 && strcmp (command, "quit") == 0) {
+            break;
+        }
+
+        if (fields == 4 && strcmp (command, "set") == 0 && row >= 0 && row < bitmap->num_rows && col >= 0 && col < bitmap->num_cols && (value == 0 || value == 1)) {
+            daemon_set (&daemon, row, col, value);
+        } else if (fields == 1 && is_outline_search (command)) {
+            daemon_query (&daemon, command, options->jobs, &figure);
+            print_figure (stdout, command, &figure);
+        } else {
+            printf ("Invalid command\n");
+        }
+        fflush (stdout);
+    }
+
+    free (line);
+    daemon_free (&daemon);
+    return VALID;
+}
+
+/**
+ * Function to build the summed-area table of a bitmap.
+ * @param bitmap Packed bitmap.
+ * @param table Pointer to the table to fill.
+ * @return VALID if the table is built, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int sum_table_build (const Bitmap *bitmap, SumTable *table) {
+    size_t width = (size_t)bitmap->num_cols + 1;
+
+    table->num_rows = bitmap->num_rows;
+    table->num_cols = bitmap->num_cols;
+    table->map = NULL;
+    table->map_size = 0;
+    table->sums = calloc (((size_t)bitmap->num_rows + 1) * width, sizeof(uint64_t));
+    if (table->sums == NULL) {
+        return MEMORY_ERROR;
+    }
+
+    for (int index = 0; index < bitmap->num_rows; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        const uint64_t *above = table->sums + (size_t)index * width;
+        uint64_t *sums = table->sums + (size_t)(index + 1) * width;
+        uint64_t count = 0;
+
+        for (int col = 0; col < bitmap->num_cols; col++) {
+            count += (row[col / WORD_BITS] >> (col % WORD_BITS)) & 1;
+            sums[col + 1] = above[col + 1] + count;
+        }
+    }
+    return VALID;
+}
+
+/**
+ * Function to free the summed-area table or unmap its index file.
+ * @param table Pointer to the table.
+ */
+void sum_table_free (SumTable *table) {
+    if (table->map != NULL) {
+        munmap (table->map, table->map_size);
+    } else {
+        free (table->sums);
+    }
+    table->sums = NULL;
+    table->map = NULL;
+}
+
+/**
+ * Function to count the ones inside a rectangle in O(1).
+ * @param table Summed-area table.
+ * @param start_x Top row of the rectangle.
+ * @param start_y Left column of the rectangle.
+ * @param end_x Bottom row of the rectangle.
+ * @param end_y Right column of the rectangle.
+ * @return Number of ones in the rectangle.
+ */
+uint64_t sum_table_count (const SumTable *table, int start_x, int start_y, int end_x, int end_y) {
+    size_t width = (size_t)table->num_cols + 1;
+    const uint64_t *top = table->sums + (size_t)start_x * width;
+    const uint64_t *bottom = table->sums + (size_t)(end_x + 1) * width;
+
+    return bottom[end_y + 1] - bottom[start_y] - top[end_y + 1] + top[start_y];
+}
+
+/**
+ * Function to fill the header describing the bitmap file an index is built from.
+ * @param filename Name of the bitmap file.
+ * @param num_rows Number of rows of the bitmap.
+ * @param num_cols Number of columns of the bitmap.
+ * @param header Pointer to the header to fill.
+ * @return VALID if the bitmap file exists, INVALID_FILE otherwise.
+ */
+int index_header (const char *filename, int num_rows, int num_cols, IndexHeader *header) {
+    struct stat info;
+
+    if (stat (filename, &info) != 0 || !S_ISREG (info.st_mode)) {
+        return INVALID_FILE;
+    }
+    memset (header, 0, sizeof(*header));
+    memcpy (header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->num_rows = num_rows;
+    header->num_cols = num_cols;
+    header->source_size = (int64_t)info.st_size;
+    header->source_sec = (int64_t)info.st_mtim.tv_sec;
+    header->source_nsec = (int64_t)info.st_mtim.tv_nsec;
+    return VALID;
+}
+
+/**
+ * Function to build the name of the index file saved next to a bitmap.
+ * @param filename Name of the bitmap file.
+ * @return Allocated name of the index file, NULL if there is a memory allocation failure.
+ */
+char *index_path (const char *filename) {
+    size_t length = strlen (filename);
+    char *path = malloc (length + sizeof(INDEX_SUFFIX));
+
+    if (path != NULL) {
+        memcpy (path, filename, length);
+        memcpy (path + length, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+    }
+    return path;
+}
+
+/**
+ * Function to map a saved index if it was built from the current version of the bitmap.
+ * @param filename Name of the bitmap file.
+ * @param table Pointer to the table to map the index into.
+ * @return VALID if the index is mapped, INVALID_FILE if it is missing or out of date.
+ */
+int index_load (const char *filename, SumTable *table) {
+    IndexHeader expected, *header;
+    struct stat info;
+    char *path = index_path (filename);
+    int fd = path != NULL ? open (path, O_RDONLY) : -1;
+
+    free (path);
+    if (fd < 0) {
+        return INVALID_FILE;
+    }
+    if (fstat (fd, &info) != 0 || (size_t)info.st_size < sizeof(IndexHeader)) {
+        close (fd);
+        return INVALID_FILE;
+    }
+
+    void *map = mmap (NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        return INVALID_FILE;
+    }
+
+    // The dimensions come from the index itself, the bitmap file is only checked for changes.
+    header = map;
+    int fresh = header->num_rows > 0 && header->num_rows <= INT_MAX && header->num_cols > 0 && header->num_cols <= INT_MAX
+                && index_header (filename, (int)header->num_rows, (int)header->num_cols, &expected) == VALID
+                && memcmp (header, &expected, sizeof(expected)) == 0
+                && (size_t)info.st_size == sizeof(IndexHeader) + ((size_t)header->num_rows + 1) * ((size_t)header->num_cols + 1) * sizeof(uint64_t);
+    if (!fresh) {
+        munmap (map, (size_t)info.st_size);
+        return INVALID_FILE;
+    }
+
+    table->num_rows = (int)header->num_rows;
+    table->num_cols = (int)header->num_cols;
+    table->sums = (uint64_t *)(header + 1);
+    table->map = map;
+    table->map_size = (size_t)info.st_size;
+    return VALID;
+}
+
+/**
+ * Function to save an index next to the bitmap. It is written to a temporary file
+ * first, so a reader never maps a half written index.
+ * @param filename Name of the bitmap file.
+ * @param table Summed-area table to save.
+ * @return VALID if the index is saved, INVALID_FILE if it cannot be written,
+ * MEMORY_ERROR if there is a memory allocation failure.
+ */
+int index_save (const char *filename, const SumTable *table) {
+    IndexHeader header;
+    char *path = index_path (filename);
+    size_t length = path != NULL ? strlen (path) : 0;
+    char *temporary = path != NULL ? malloc (length + sizeof(".tmp")) : NULL;
+
+    if (temporary == NULL) {
+        free (path);
+        return MEMORY_ERROR;
+    }
+    memcpy (temporary, path, length);
+    memcpy (temporary + length, ".tmp", sizeof(".tmp"));
+
+    size_t count = ((size_t)table->num_rows + 1) * ((size_t)table->num_cols + 1);
+    FILE *file = NULL;
+    int status = index_header (filename, table->num_rows, table->num_cols, &header);
+    if (status == VALID) {
+        file = fopen (temporary, "wb");
+        status = file != NULL ? VALID : INVALID_FILE;
+    }
+    if (status == VALID && (fwrite (&header, sizeof(header), 1, file) != 1 || fwrite (table->sums, sizeof(uint64_t), count, file) != count)) {
+        status = INVALID_FILE;
+    }
+    if (file != NULL && fclose (file) != 0) {
+        status = INVALID_FILE;
+    }
+    if (status == VALID && rename (temporary, path) != 0) {
+        status = INVALID_FILE;
+    }
+    if (status != VALID && file != NULL) {
+        remove (temporary);
+    }
+
+    free (temporary);
+    free (path);
+    return status;
+}
+
+/**
+ * Function to answer rectangle queries read from the standard input. Every line holds
+ * <start_x> <start_y> <end_x> <end_y> and is answered with the number of ones in the
+ * rectangle and whether it is full, empty or partial. Blank lines are skipped, every
+ * other line gets an answer, "Invalid query" if it is not a rectangle of the bitmap.
+ * @param filename Name of the bitmap file.
+ * @param options Options, with --index the summed-area table is saved next to the
+ * bitmap and reloaded from there while the bitmap does not change.
+ * @return Status code indicating the result of the operation.
+ */
+int run_query (const char *filename, const Options *options) {
+    SumTable table;
+    char *line = NULL;
+    size_t size = 0;
+
+    if (!options->index || strcmp (filename, "-") == 0 || index_load (filename, &table) != VALID) {
+        Bitmap bitmap;
+        int status = validity_check (filename, &bitmap);
+        if (status != VALID) {
+            return status;
+        }
+        status = sum_table_build (&bitmap, &table);
+        bitmap_free (&bitmap);
+        if (status != VALID) {
+            return status;
+        }
+        // A missing index only makes the next run slower, so a failed save is just reported.
+        if (options->index && strcmp (filename, "-") != 0 && index_save (filename, &table) != VALID) {
+            fprintf (stderr, "Cannot save the index\n");
+        }
+    }
+
+    // The queries are timed as the search, reading them included.
+    StatsClock clock;
+    stats_start (&clock);
+    while (getline (&line, &size, stdin) >= 0) {
+        int start_x, start_y, end_x, end_y;
+        char extra;
+        if (is_blank_line (line)) {
+            continue;
+        }
+        int fields = sscanf (line, "%d %d %d %d %c", &start_x, &start_y, &end_x, &end_y, &extra);
+
+        if (fields != 4 || start_x < 0 || start_y < 0 || start_x > end_x || start_y > end_y || end_x >= table.num_rows || end_y >= table.num_cols) {
+            printf ("Invalid query\n");
+            continue;
+        }
+
+        uint64_t count = sum_table_count (&table, start_x, start_y, end_x, end_y);
+        uint64_t area = (uint64_t)(end_x - start_x + 1) * (uint64_t)(end_y - start_y + 1);
+        printf ("%llu %s\n", (unsigned long long)count, count == area ? "full" : (count == 0 ? "empty" : "partial"));
+    }
+
+    stats_stop (search_phase ("query"), &clock);
+    free (line);
+    sum_table_free (&table);
+    return VALID;
+}
+
+/**
+ * Function to find the root of a run in the union-find forest, halving the path on the way.
+ * @param parent Parent of every run.
+ * @param run Index of the run.
+ * @return Index of the root.
+ */
+size_t label_find (size_t *parent, size_t run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+/**
+ * Function to join the components of two runs. The smaller index becomes the root, so
+ * the root of a component is always its first run in row order.
+ * @param parent Parent of every run.
+ * @param first Index of the first run.
+ * @param second Index of the second run.
+ */
+void label_union (size_t *parent, size_t first, size_t second) {
+    first = label_find (parent, first);
+    second = label_find (parent, second);
+    if (first < second) {
+        parent[second] = first;
+    } else if (second < first) {
+        parent[first] = second;
+    }
+}
+
+/**
+ * Function to join the runs of a row with the runs touching them in the row above.
+ * @param task The labeling task, for the runs and the connectivity.
+ * @param row Index of the lower row.
+ */
+void label_rows (const LabelTask *task, int row) {
+    size_t above = task->offsets[row - 1], above_end = task->offsets[row];
+    size_t below = task->offsets[row], below_end = task->offsets[row + 1];
+    // With 8-connectivity runs that only touch at a corner are joined too.
+    int reach = task->connectivity == 8;
+
+    while (above < above_end && below < below_end) {
+        const Span *up = &task->runs[above];
+        const Span *down = &task->runs[below];
+
+        if (down->first < up->end + reach && up->first < down->end + reach) {
+            label_union (task->parent, above, below);
+        }
+        if (up->end < down->end) {
+            above++;
+        } else {
+            below++;
+        }
+    }
+}
+
+/**
+ * First pass of the labeling: counts the runs of every row of a band.
+ * @param argument The labeling task.
+ * @return NULL.
+ */
+void *label_count_task (void *argument) {
+    LabelTask *task = argument;
+    const Bitmap *bitmap = task->bitmap;
+
+    for (int index = task->first; index < task->last; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        size_t count = 0;
+        int col = 0;
+
+        while ((col = next_one (row, col, bitmap->num_cols)) < bitmap->num_cols) {
+            col = next_zero (row, col, bitmap->num_cols);
+            count++;
+        }
+        task->offsets[index + 1] = count;
+    }
+    return NULL;
+}
+
+/**
+ * Second pass of the labeling: stores the runs of a band and joins those that touch.
+ * Every band only writes the parents of its own runs, the rows on the seams between
+ * bands are joined afterwards.
+ * @param argument The labeling task.
+ * @return NULL.
+ */
+void *label_task (void *argument) {
+    LabelTask *task = argument;
+    const Bitmap *bitmap = task->bitmap;
+
+    for (int index = task->first; index < task->last; index++) {
+        const uint64_t *row = bitmap_row (bitmap, index);
+        size_t run = task->offsets[index];
+        int col = 0;
+
+        while ((col = next_one (row, col, bitmap->num_cols)) < bitmap->num_cols) {
+            int end = next_zero (row, col, bitmap->num_cols);
+
+            task->runs[run] = (Span){col, end, index};
+            task->parent[run] = run;
+            run++;
+            col = end;
+        }
+        if (index > task->first) {
+            label_rows (task, index);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function to label the connected components of ones and print their number, then the
+ * pixel count and the bounding box of each, in the order of their first pixel.
+ * The runs of ones are labeled with a union-find, in parallel bands of rows that are
+ * merged at their seams.
+ * @param bitmap Packed bitmap.
+ * @param options Options, for the number of threads and the connectivity.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int run_components (const Bitmap *bitmap, const Options *options) {
+    LabelTask tasks[MAX_JOBS];
+    int num_rows = bitmap->num_rows;
+    int count = task_count (options->jobs, num_rows);
+    size_t *offsets = calloc ((size_t)num_rows + 1, sizeof(size_t));
+    StatsClock clock;
+
+    if (offsets == NULL) {
+        return MEMORY_ERROR;
+    }
+
+    stats_start (&clock);
+    for (int index = 0; index < count; index++) {
+        tasks[index] = (LabelTask){ bitmap, (int)((long long)num_rows * index / count), (int)((long long)num_rows * (index + 1) / count),
+                                    options->connectivity, offsets, NULL, NULL };
+    }
+    run_parallel (label_count_task, tasks, sizeof(LabelTask), count);
+
+    for (int index = 0; index < num_rows; index++) {
+        offsets[index + 1] += offsets[index];
+    }
+
+    size_t total = offsets[num_rows];
+    Span *runs = malloc ((total > 0 ? total : 1) * sizeof(Span));
+    size_t *parent = malloc ((total > 0 ? total : 1) * sizeof(size_t));
+    Component *components = NULL;
+    size_t found = 0, capacity = 0;
+    int status = runs != NULL && parent != NULL ? VALID : MEMORY_ERROR;
+
+    if (status == VALID) {
+        for (int index = 0; index < count; index++) {
+            tasks[index].runs = runs;
+            tasks[index].parent = parent;
+        }
+        run_parallel (label_task, tasks, sizeof(LabelTask), count);
+        for (int index = 1; index < count; index++) {
+            if (tasks[index].first > 0 && tasks[index].first < tasks[index].last) {
+                label_rows (&tasks[index], tasks[index].first);
+            }
+        }
+    }
+
+    // Parents always have smaller indices, so in run order the parent of a run is already
+    // numbered and the parent array can be reused for the component numbers.
+    for (size_t run = 0; run < total && status == VALID; run++) {
+        const Span *span = &runs[run];
+
+        if (parent[run] == run) {
+            if (found == capacity) {
+                size_t size = capacity == 0 ? 64 : capacity * 2;
+                Component *items = realloc (components, size * sizeof(Component));
+                if (items == NULL) {
+                    status = MEMORY_ERROR;
+                    break;
+                }
+                components = items;
+                capacity = size;
+            }
+            components[found] = (Component){ 0, span->start, span->first, span->start, span->end - 1 };
+            parent[run] = found++;
+        } else {
+            parent[run] = parent[parent[run]];
+        }
+
+        Component *component = &components[parent[run]];
+        component->pixels += (uint64_t)(span->end - span->first);
+        component->start_y = span->first < component->start_y ? span->first : component->start_y;
+        component->end_x = span->start;
+        component->end_y = span->end - 1 > component->end_y ? span->end - 1 : component->end_y;
+    }
+
+    stats_stop (search_phase ("components"), &clock);
+
+    if (status == VALID) {
+        printf ("%zu\n", found);
+        for (size_t index = 0; index < found; index++) {
+            const Component *component = &components[index];
+            printf ("%llu %d %d %d %d\n", (unsigned long long)component->pixels, component->start_x, component->start_y, component->end_x, component->end_y);
+        }
+    }
+
+    free (offsets);
+    free (runs);
+    free (parent);
+    free (components);
+    return status;
+}
+
+/**
+ * Function to check whether an operation is one of the searches run on a bitmap.
+ * @param operation Name of the operation.
+ * @return 1 if it is test, hline, vline, square, rect, fsquare, dline or adline, 0 otherwise.
+ */
+int is_search (const char *operation) {
+    return strcmp (operation, "test") == 0 || is_outline_search (operation) || strcmp (operation, "rect") == 0 || strcmp (operation, "fsquare") == 0
+           || strcmp (operation, "dline") == 0 || strcmp (operation, "adline") == 0;
+}
+
+/**
+ * Function to check whether an operation searches for lines or square outlines, the
+ * searches offered by the top K and ties modes and by the daemon.
+ * @param operation Name of the operation.
+ * @return 1 if it is hline, vline or square, 0 otherwise.
+ */
+int is_outline_search (const char *operation) {
+    return strcmp (operation, "hline") == 0 || strcmp (operation, "vline") == 0 || strcmp (operation, "square") == 0;
+}
+
+/**
+ * Function to run one search operation on a loaded bitmap.
+ * @param bitmap Packed bitmap.
+ * @param operation Operation to perform (test, hline, vline, square, rect, fsquare, dline, adline).
+ * @param jobs Number of threads for the search.
+ * @param figure Pointer to store the figure found, its size is 0 for test.
+ * @return VALID on success, MEMORY_ERROR if there is a memory allocation failure.
+ */
+int run_operation (const Bitmap *bitmap, const char *operation, int jobs, Figure *figure) {
+    long long size = 0;
+    StatsClock clock;
+
+    stats_start (&clock);
+    figure->size = 0;
+    if (strcmp (operation, "hline") == 0) {
+        size = find_hline (bitmap, jobs, figure);
+    } else if (strcmp (operation, "vline") == 0) {
+        size = find_vline (bitmap, jobs, figure);
+    } else if (strcmp (operation, "square") == 0) {
+        size = find_square (bitmap, jobs, figure);
+    } else if (strcmp (operation, "rect") == 0) {
+        size = find_rect (bitmap, figure);
+    } else if (strcmp (operation, "fsquare") == 0) {
+        size = find_fsquare (bitmap, figure);
+    } else if (strcmp (operation, "dline") == 0 || strcmp (operation, "adline") == 0) {
+        size = find_dline (bitmap, jobs, strcmp (operation, "adline") == 0, figure);
+    }
+    stats_stop (search_phase (operation), &clock);
+    return size < 0 ? MEMORY_ERROR : VALID;
+}
+
+/**
+ * Function to print the figure found by an operation.
+ * @param out Stream to print to.
+ * @param operation Operation that found the figure (hline, vline, square, rect, fsquare, dline, adline).
+ * @param figure The figure, its size is 0 if nothing was found.
+ */
+void print_figure (FILE *out, const char *operation, const Figure *figure) {
+    if (figure->size > 0) {
+        fprintf (out, "%d %d %d %d\n", figure->start_x, figure->start_y, figure->end_x, figure->end_y);
+    } else if (strcmp (operation, "hline") == 0) {
+        fprintf (out, "No horizontal line found.\n");
+    } else if (strcmp (operation, "vline") == 0) {
+        fprintf (out, "No vertical line found.\n");
+    } else if (strcmp (operation, "rect") == 0) {
+        fprintf (out, "No rectangle found.\n");
+    } else if (strcmp (operation, "fsquare") == 0) {
+        fprintf (out, "No filled square found.\n");
+    } else if (strcmp (operation, "dline") == 0) {
+        fprintf (out, "No diagonal line found.\n");
+    } else if (strcmp (operation, "adline") == 0) {
+        fprintf (out, "No anti-diagonal line found.\n");
+    } else {
+        fprintf (out, "No square found.\n");
+    }
+}
+
+/**
+ * Function to run all operations of a batch on one file, reading the bitmap only once.
+ * Every operation prints one line: the filename, the operation and its result.
+ * @param job The file and the operations.
+ */
+void batch_file (BatchJob *job) {
+    Bitmap bitmap;
+    Figure figure;
+    size_t length;
+    FILE *out = open_memstream (&job->output, &length);
+
+    if (out == NULL) {
+        job->status = MEMORY_ERROR;
+        return;
+    }
+
+    job->status = validity_check (job->filename, &bitmap);
+    int loaded = job->status == VALID;
+    for (int index = 0; index < job->batch->count; index++) {
+        const char *operation = job->batch->operations[index];
+        int status = job->status;
+
+        if (status == VALID) {
+            status = run_operation (&bitmap, operation, job->batch->jobs, &figure);
+        }
+
+        fprintf (out, "%s %s ", job->filename, operation);
+        if (status == INVALID_FILE) {
+            fprintf (out, "Invalid\n");
+        } else if (status == MEMORY_ERROR) {
+            fprintf (out, "Allocation failure\n");
+        } else if (strcmp (operation, "test") == 0) {
+            fprintf (out, "Valid\n");
+        } else {
+            print_figure (out, operation, &figure);
+        }
+
+        if (job->status == VALID) {
+            job->status = status;
+        }
+    }
+
+    if (loaded) {
+        bitmap_free (&bitmap);
+    }
+    fclose (out);
+}
+
+/**
+ * Work of one batch thread: take the next file of the round until none is left.
+ * @param argument The batch.
+ * @return NULL.
+ */
+void *batch_task (void *argument) {
+    Batch *batch = *(Batch **)argument;
+    int index;
+
+    while ((index = atomic_fetch_add (&batch->next, 1)) < batch->pending) {
+        batch_file (&batch->files[index]);
+    }
+    return NULL;
+}
+
+/**
+ * Function to run the files collected so far and print their results in order.
+ * @param batch The batch.
+ * @param result Pointer to the overall result, set by the first file that fails.
+ */
+void batch_flush (Batch *batch, int *result) {
+    Batch *workers[MAX_JOBS];
+    int count = task_count (batch->files_jobs, batch->pending);
+
+    // Threads that are not needed for whole files help with the searches instead.
+    batch->jobs = batch->files_jobs / count > 0 ? batch->files_jobs / count : 1;
+    atomic_store (&batch->next, 0);
+    for (int index = 0; index < count; index++) {
+        workers[index] = batch;
+    }
+    run_parallel (batch_task, workers, sizeof(Batch *), count);
 
-// Define constants for various errors and statuses.
-#define VALID 0
-#define INVALID_FILE 1
-#define INVALID_ARGS 2
-#define NUM_OF_ARGS 3
-#define MEMORY_ERROR 4
+    for (int index = 0; index < batch->pending; index++) {
+        BatchJob *job = &batch->files[index];
+        if (job->output != NULL) {
+            fputs (job->output, stdout);
+            free (job->output);
+        }
+        if (*result == VALID) {
+            *result = job->status;
+        }
+        free (job->filename);
+    }
+    batch->pending = 0;
+}
 
-// Function prototypes.
-void process (const char *filename, const char *operation, int *result);
+/**
+ * Function to add a file to the batch, running the round once it is full.
+ * @param batch The batch.
+ * @param filename Name of the file.
+ * @param result Pointer to the overall result.
+ */
+void batch_add (Batch *batch, const char *filename, int *result) {
+    BatchJob *job = &batch->files[batch->pending];
+
+    job->filename = malloc (strlen (filename) + 1);
+    if (job->filename == NULL) {
+        *result = *result == VALID ? MEMORY_ERROR : *result;
+        return;
+    }
+    strcpy (job->filename, filename);
+    job->output = NULL;
+    job->batch = batch;
+    if (++batch->pending == BATCH_ROUND) {
+        batch_flush (batch, result);
+    }
+}
 
 /**
- * Main function to start the program.
- * @param argc Number of command line arguments.
- * @param argv Array of command line arguments.
- * @return Status code indicating the result of the program execution.
+ * Function to run a set of operations on a list of files. Each bitmap is read once and
+ * all operations run on it; with -j N the files are processed by N threads, and the
+ * results are still printed in the order of the files.
+ * @param operations Comma separated list of operations.
+ * @param filenames Names of the files, or NULL to read them from the standard input,
+ *                  one per line.
+ * @param count Number of filenames.
+ * @param options Command line options.
+ * @return VALID if all files are valid, otherwise the result of the first file that is not.
  */
-int main(int argc, char *argv[]) {
-    // Check if the number of arguments is correct.
-    if (argc != NUM_OF_ARGS) {
-        fprintf (stderr, "Invalid arguments\n");
+int process_batch (const char *operations, char **filenames, int count, const Options *options) {
+    Batch batch = {0};
+    char list[MAX_ARG_LENGHT];
+    int result = VALID;
+
+    // Split the list of operations.
+    if (strlen (operations) >= sizeof(list)) {
+        return INVALID_ARGS;
+    }
+    strcpy (list, operations);
+    for (char *operation = strtok (list, ","); operation != NULL; operation = strtok (NULL, ",")) {
+        if (!is_search (operation) || batch.count == MAX_OPERATIONS) {
+            return INVALID_ARGS;
+        }
+        batch.operations[batch.count++] = operation;
+    }
+    if (batch.count == 0) {
         return INVALID_ARGS;
     }
 
-    int result;
-    // Process the input file and operation.
-    process(argv[2], argv[1], &result);
+    batch.files_jobs = options->jobs;
+    if (filenames != NULL) {
+        for (int index = 0; index < count; index++) {
+            batch_add (&batch, filenames[index], &result);
+        }
+    } else {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
 
-    // Handle the result.
-    switch (result) {
-        case VALID:
-            if (strcmp (argv[1], "test") == 0) {
-                fprintf (stdout, "Valid\n");
+        while ((length = getline (&line, &size, stdin)) >= 0) {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                line[--length] = '\0';
             }
-            break;
+            if (length > 0) {
+                batch_add (&batch, line, &result);
+            }
+        }
+        free (line);
+    }
 
-        case INVALID_FILE:
-            fprintf (stderr, "Invalid\n");
-            break;
+    if (batch.pending > 0) {
+        batch_flush (&batch, &result);
+    }
+    return result;
+}
 
-        case MEMORY_ERROR:
-            fprintf (stderr, "Allocation failure\n");
-            break;
+/**
+ * Main process function to handle the operations.
+ * @param filename Name of the text file, "-" for the standard input.
+ * @param operation Operation to perform (test, hline, vline, square, --help).
+ * @param options Command line options.
+ * @param result Pointer to store the result of the operation.
+ */
+void process (const char *filename, const char *operation, const Options *options, int *result) {
+    Bitmap bitmap;
+    Figure figure;
 
-        default:
-            fprintf (stderr, "Unkown error\n");
-            break;
+    // Run-length encoded files are searched on their runs, without expanding them.
+    if (is_outline_search (operation) && options->top == 0 && !options->ties && strcmp (filename, "-") != 0 && is_rle_file (filename)) {
+        *result = sparse_search (filename, operation, &figure);
+        if (*result == VALID) {
+            print_figure (stdout, operation, &figure);
+        }
+        return;
     }
 
-    return result;
+    // The validation never needs the bitmap in memory.
+    if (strcmp (operation, "test") == 0) {
+        *result = validate_file (filename);
+        return;
+    }
+
+    // Neither do the line searches.
+    if (options->stream && options->top == 0 && !options->ties && (strcmp (operation, "hline") == 0 || strcmp (operation, "vline") == 0)) {
+        *result = stream_search (filename, operation, &figure);
+        if (*result == VALID) {
+            print_figure (stdout, operation, &figure);
+        }
+        return;
+    }
+
+    // Queries may be answered from a saved index without reading the bitmap.
+    if (strcmp (operation, "query") == 0) {
+        *result = run_query (filename, options);
+        return;
+    }
+
+    // Check the validity of the file and read the bitmap.
+    *result = validity_check (filename, &bitmap);
+    if (*result != VALID) {
+        return;
+    } 
+
+    if (strcmp (operation, "--help") == 0) {
+        printf ("Usage: figsearch [--stream] [-j N] [--top K | --ties] [--index] [--stats] [--conn 4|8] <operation> <filename>\n" 
+                "       figsearch [-j N] --batch <operation,...> [filename...]\n" 
+                "Operations:\n"
+                " --help Show this help message and exit.\n" 
+                " test Validate the bitmap file format in a single pass, without keeping it.\n" 
+                " hline Find the longest horizontal line.\n" 
+                " vline Find the longest vertical line.\n" 
+                " square Find the largest square.\n" 
+                " rect Find the largest rectangle filled with ones.\n"
+                " fsquare Find the largest square filled with ones.\n"
+                " dline Find the longest diagonal line going down and right.\n"
+                " adline Find the longest anti-diagonal line going down and left.\n"
+                " daemon Keep the bitmap in memory and read commands from the standard input:\n"
+                "        set <row> <col> <0|1>, hline, vline, square and quit.\n"
+                " components Label the connected figures of ones and print their number, then\n"
+                "            the pixel count and the bounding box of each.\n"
+                " query Read <start_x> <start_y> <end_x> <end_y> rectangles from the standard\n"
+                "       input and print the number of ones in each and full, empty or partial.\n"
+                "Besides the text format, plain (P1) and packed (P4) PBM files are accepted.\n"
+                "Sparse bitmaps may be run-length encoded: RLE <rows> <cols>, then for every row\n"
+                "the number of runs of ones and <start> <length> of each, left to right.\n"
+                "Options:\n"
+                " --stream Run hline and vline while reading, without keeping the bitmap\n"
+                "          in memory. Use - as the filename to read the standard input.\n"
+                " -j N Split the search between N threads, 0 for one per processor.\n"
+                " --batch Run the listed operations on every file, reading each file once.\n"
+                "         Without filenames, the files are read from the standard input.\n"
+                "         With -j N, N files are processed at once.\n"
+                " --top K Print the K longest lines or largest squares, one per line.\n"
+                " --ties Print all lines or squares of the largest size.\n"
+                "        Lines are whole runs, squares are every corner and size that fits.\n"
+                " --stats Print the wall and CPU time of opening, allocating, parsing and\n"
+                "         searching, in total and for each search operation, the pixels\n"
+                "         and bytes read, the square candidates and the peak memory to\n"
+                "         stderr as key=value lines.\n"
+                " --conn 4|8 Connectivity of the components, 4 by default.\n"
+                " --index With query, save the index next to the bitmap as <filename>.sat\n"
+                "         and reuse it while the bitmap does not change.\n"
+                "\n"
+                "Description:\n" 
+                " The figsearch program processes a bitmap file and performs various\n" 
+                " operations to analyze the content.");
+
+    } else if (strcmp (operation, "daemon") == 0) {
+        *result = run_daemon (&bitmap, options);
+
+    } else if (strcmp (operation, "components") == 0) {
+        *result = run_components (&bitmap, options);
+
+    } else if (is_outline_search (operation) && (options->top > 0 || options->ties)) {
+        *result = run_ranking (&bitmap, operation, options);
+
+    } else if (is_search (operation)) {
+        *result = run_operation (&bitmap, operation, options->jobs, &figure);
+        if (*result == VALID) {
+            print_figure (stdout, operation, &figure);
+        }
+    } else {
+        printf ("Unknown operation.\n");
+    }
+
+    // Free allocated memory.
+    bitmap_free (&bitmap);
 }
 
-/**  
- * Function to chcek the validity of the bitmap file and read its content.
- * @param filename Name of the text file.
- * @param num_rows Pointer to store the number of rows.
- * @param num_cols Pointer to store the number of columns.
- * @param bitmap Pointer to store the 2D array of the bitmap.
- * @return VALID if the file is valid, 
- *         INVALID_FILE if the file is invalid,
- *         MEMORY_ERROR if there is a memory allocation failure.
-*/
-int validity_check(const char *filename, int *num_rows, int *num_cols, int ***bitmap) {
+#ifdef FIGSEARCH_BENCH
+/**
+ * Function to get the next number of the benchmark generator (xorshift64*).
+ * @param state State of the generator, must not be 0.
+ * @return Random 64-bit number.
+ */
+uint64_t bench_random (uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Function to generate a benchmark bitmap.
+ * @param bitmap Bitmap to generate, already initialized and empty.
+ * @param kind Kind of the bitmap: random, ones, checkerboard, nested (square outlines
+ *             inside each other), hline or vline (a single line across the bitmap).
+ * @param density Share of set pixels of a random bitmap.
+ * @param seed Seed of the generator.
+ */
+void bench_generate (Bitmap *bitmap, const char *kind, double density, uint64_t seed) {
+    uint64_t state = seed != 0 ? seed : 1;
+    uint64_t threshold = density >= 1.0 ? UINT64_MAX : (uint64_t)(density * 18446744073709551616.0);
+    int num_rows = bitmap->num_rows;
+    int num_cols = bitmap->num_cols;
+    int side = num_rows < num_cols ? num_rows : num_cols;
 
-    int value = 0;
-    int row_count = 0;
+    for (int row = 0; row < num_rows; row++) {
+        for (int col = 0; col < num_cols; col++) {
+            int set = 0;
 
-    // Open the file for reading.
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        return INVALID_FILE;
+            if (strcmp (kind, "random") == 0) {
+                set = bench_random (&state) < threshold;
+            } else if (strcmp (kind, "ones") == 0) {
+                set = 1;
+            } else if (strcmp (kind, "checkerboard") == 0) {
+                set = (row + col) % 2 == 0;
+            } else if (strcmp (kind, "nested") == 0 && row < side && col < side) {
+                // Distance to the nearest edge of the square, every other ring is set.
+                int ring = row < col ? row : col;
+                int far = side - 1 - row < side - 1 - col ? side - 1 - row : side - 1 - col;
+                set = (ring < far ? ring : far) % 2 == 0;
+            } else if (strcmp (kind, "hline") == 0) {
+                set = row == num_rows / 2;
+            } else if (strcmp (kind, "vline") == 0) {
+                set = col == num_cols / 2;
+            }
+
+            if (set) {
+                bitmap_set (bitmap, row, col);
+            }
+        }
     }
+}
 
-    // Read the number of rows and columns.
-    if (fscanf (file, "%d %d", num_rows, num_cols) != 2 || *num_rows <= 0 || *num_cols <= 0) {
-        fclose (file);
+/**
+ * Function to write a bitmap into a temporary file.
+ * @param bitmap Bitmap to write.
+ * @param packed 1 for a packed PBM file, 0 for the text format.
+ * @param filename Buffer of at least 64 bytes to store the name of the file.
+ * @return VALID on success, INVALID_FILE if the file cannot be written.
+ */
+int bench_write (const Bitmap *bitmap, int packed, char *filename) {
+    const char *directory = getenv ("TMPDIR") != NULL ? getenv ("TMPDIR") : "/tmp";
+    snprintf (filename, 64, "%.40s/figsearch-XXXXXX", directory);
+
+    int fd = mkstemp (filename);
+    FILE *file = fd >= 0 ? fdopen (fd, "w") : NULL;
+    if (file == NULL) {
         return INVALID_FILE;
     }
 
-    // Allocate memory for the bitmap. 
-    *bitmap = malloc (*num_rows * sizeof(int *));
-    if (*bitmap == NULL) {
-        fclose (file);
-        return MEMORY_ERROR;
+    if (packed) {
+        fprintf (file, "P4\n%d %d\n", bitmap->num_cols, bitmap->num_rows);
+    } else {
+        fprintf (file, "%d %d\n", bitmap->num_rows, bitmap->num_cols);
     }
 
-    // Allocate memory for each row of the bitmap.
-    for (int index  = 0; index < *num_rows; index++) {
-        (*bitmap)[index] = malloc(*num_cols * sizeof(int));
-        if ((*bitmap)[index] == NULL) {
-            for (int index2 = 0; index2 < index; index2++) {
-                free ((*bitmap)[index2]);
+    for (int row = 0; row < bitmap->num_rows; row++) {
+        if (packed) {
+            for (int col = 0; col < bitmap->num_cols; col += 8) {
+                int byte = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    byte = byte << 1 | (col + bit < bitmap->num_cols ? bitmap_get (bitmap, row, col + bit) : 0);
+                }
+                putc (byte, file);
+            }
+        } else {
+            for (int col = 0; col < bitmap->num_cols; col++) {
+                putc ('0' + bitmap_get (bitmap, row, col), file);
+                putc (col + 1 < bitmap->num_cols ? ' ' : '\n', file);
             }
-            free (*bitmap);
-            fclose (file);
-            return MEMORY_ERROR;
         }
     }
+    return fclose (file) == 0 ? VALID : INVALID_FILE;
+}
 
-    // Read the bitmap values.
-    while (row_count < *num_rows) {
-        for (int index = 0; index < *num_cols; index++) {
-            if (fscanf(file, "%d", &value) != 1) {
-                fclose (file);
-                return INVALID_FILE;
-            }
-            if (value != 0 && value != 1) {
-                fclose (file);
-                return INVALID_FILE;
-            }
-            (*bitmap)[row_count][index] = value;
+/**
+ * Work of the thread feeding a file into a pipe, so the benchmark can parse from a pipe.
+ * @param argument Pointer to two descriptors: the file and the write end of the pipe.
+ * @return NULL.
+ */
+void *bench_feed (void *argument) {
+    int *fds = argument;
+    char buffer[READ_CHUNK];
+    ssize_t count;
 
+    while ((count = read (fds[0], buffer, sizeof(buffer))) > 0) {
+        if (write (fds[1], buffer, (size_t)count) != count) {
+            break;
         }
-        row_count++;
     }
+    close (fds[0]);
+    close (fds[1]);
+    return NULL;
+}
 
-    // Check for extra characters after reading bitmap values.
-    int c;
-    do {
-        c = getc(file);
-    } while (isblank(c));
-    
-    if (c != EOF && c != '\n' && c != '\r') {
-        fclose (file);
+/**
+ * Function to parse a benchmark file through a pipe instead of a mapping.
+ * @param filename Name of the file.
+ * @param bitmap Pointer to store the bitmap.
+ * @return Result of validity_check.
+ */
+int bench_parse_pipe (const char *filename, Bitmap *bitmap) {
+    int pipe_fds[2];
+    int fds[2];
+    char name[32];
+    pthread_t thread;
+
+    if (pipe (pipe_fds) != 0) {
+        return INVALID_FILE;
+    }
+    fds[0] = open (filename, O_RDONLY);
+    fds[1] = pipe_fds[1];
+    if (fds[0] < 0 || pthread_create (&thread, NULL, bench_feed, fds) != 0) {
+        close (pipe_fds[0]);
+        close (pipe_fds[1]);
         return INVALID_FILE;
     }
 
-    fclose (file);
-    return VALID;
+    snprintf (name, sizeof(name), "/dev/fd/%d", pipe_fds[0]);
+    int status = validity_check (name, bitmap);
+    close (pipe_fds[0]);
+    pthread_join (thread, NULL);
+    return status;
 }
 
-/**  
- * Function to find the longest horizontal line in the bitmap.
+/**
+ * Function to build the int** copy of a bitmap the reference implementation works on.
+ * @param bitmap Packed bitmap.
+ * @return The rows, NULL if there is a memory allocation failure.
+ */
+int **reference_rows (const Bitmap *bitmap) {
+    int **rows = calloc (bitmap->num_rows, sizeof(int *));
+    if (rows == NULL) {
+        return NULL;
+    }
+
+    for (int row = 0; row < bitmap->num_rows; row++) {
+        rows[row] = malloc (bitmap->num_cols * sizeof(int));
+        if (rows[row] == NULL) {
+            for (int index = 0; index < row; index++) {
+                free (rows[index]);
+            }
+            free (rows);
+            return NULL;
+        }
+        for (int col = 0; col < bitmap->num_cols; col++) {
+            rows[row][col] = bitmap_get (bitmap, row, col);
+        }
+    }
+    return rows;
+}
+
+/**
+ * Reference horizontal line search, the original pixel by pixel implementation.
  * @param num_rows Number of rows in the bitmap.
  * @param num_cols Number of columns in the bitmap.
  * @param bitmap 2D array of the bitmap.
- * @param start_x Pointer to store the starting x-coordinates of the line.
- * @param start_y Pointer to store the starting y-coordinates of the line.
- * @param end_x Pointer to store the ending x-coordinates of the line.
- * @param end_y Pointer to store the ending y-coordinates of the line.
- * @return Lenght of the longest horizontal line found. 
- * */
-int find_hline (int num_rows, int num_cols, int **bitmap, int *start_x, int *start_y, int *end_x, int *end_y) {
-    int max_lenght = 0;
+ * @param figure Pointer to store the line.
+ */
+void reference_hline (int num_rows, int num_cols, int **bitmap, Figure *figure) {
     int current_lenght = 0;
-    int current_start_x, current_start_y;
+    int current_start_x = 0, current_start_y = 0;
 
+    figure->size = 0;
     for (int index = 0; index < num_rows; index++) {
         current_lenght = 0;
         for (int index2 = 0; index2 < num_cols; index2++) {
@@ -161,38 +3937,32 @@ int find_hline (int num_rows, int num_cols, int **bitmap, int *start_x, int *sta
                 }
                 current_lenght++;
 
-                if (current_lenght > max_lenght || (current_lenght == max_lenght && (current_start_x < *start_x || (current_start_x == *start_x && current_start_y < *start_y)))){
-                    max_lenght = current_lenght;
-                    *start_x = current_start_x;
-                    *start_y = current_start_y;
-                    *end_x = index;
-                    *end_y = index2;
+                if (figure_better (figure, current_lenght, current_start_x, current_start_y)) {
+                    figure->size = current_lenght;
+                    figure->start_x = current_start_x;
+                    figure->start_y = current_start_y;
+                    figure->end_x = index;
+                    figure->end_y = index2;
                 }
-
             } else {
                 current_lenght = 0;
             }
         }
     }
-    return max_lenght;
 }
 
 /**
- *  Function to find the longest vertical line in the bitmap.
+ * Reference vertical line search, the original pixel by pixel implementation.
  * @param num_rows Number of rows in the bitmap.
  * @param num_cols Number of columns in the bitmap.
  * @param bitmap 2D array of the bitmap.
- * @param start_x Pointer to store the starting x-coordinates of the line.
- * @param start_y Pointer to store the starting y-coordinates of the line.
- * @param end_x Pointer to store the ending x-coordinates of the line.
- * @param end_y Pointer to store the ending y-coordinates of the line.
- * @return Lenght of the longest vertical line found. 
- */
-int find_vline (int num_rows, int num_cols, int **bitmap, int *start_x, int *start_y, int *end_x, int *end_y) {
-    int max_lenght = 0;
+ * @param figure Pointer to store the line.
+ */
+void reference_vline (int num_rows, int num_cols, int **bitmap, Figure *figure) {
     int current_lenght = 0;
-    int current_start_x, current_start_y;
+    int current_start_x = 0, current_start_y = 0;
 
+    figure->size = 0;
     for (int index2 = 0; index2 < num_cols; index2++) {
         current_lenght = 0;
         for (int index = 0; index < num_rows; index++) {
@@ -201,38 +3971,31 @@ int find_vline (int num_rows, int num_cols, int **bitmap, int *start_x, int *sta
                     current_start_x = index;
                     current_start_y = index2;
                 }
-                current_lenght++; 
-
-                if (current_lenght > max_lenght || (current_lenght == max_lenght && (current_start_x < *start_x || (current_start_x == *start_x &&  current_start_y < *start_y)))) {
-                    max_lenght = current_lenght;
-                    *start_x = current_start_x;
-                    *start_y = current_start_y;
-                    *end_x = index;
-                    *end_y = index2;
-                }
+                current_lenght++;
 
+                if (figure_better (figure, current_lenght, current_start_x, current_start_y)) {
+                    figure->size = current_lenght;
+                    figure->start_x = current_start_x;
+                    figure->start_y = current_start_y;
+                    figure->end_x = index;
+                    figure->end_y = index2;
+                }
             } else {
                 current_lenght = 0;
             }
         }
     }
-    return max_lenght;
 }
 
 /**
- *  Function to find the largest square in the bitmap.
+ * Reference square search, the original brute force over all corners and sizes.
  * @param num_rows Number of rows in the bitmap.
  * @param num_cols Number of columns in the bitmap.
  * @param bitmap 2D array of the bitmap.
- * @param start_x Pointer to store the starting x-coordinates of the square.
- * @param start_y Pointer to store the starting y-coordinates of the square.
- * @param end_x Pointer to store the ending x-coordinates of the square.
- * @param end_y Pointer to store the ending y-coordinates of the square.
- * @return Size of the largest square found. 
+ * @param figure Pointer to store the square.
  */
-int find_square (int num_rows, int num_cols, int **bitmap, int *start_x, int *start_y, int *end_x, int *end_y) {
-    int maximum_size = 0;
-
+void reference_square (int num_rows, int num_cols, int **bitmap, Figure *figure) {
+    figure->size = 0;
     for (int index = 0; index < num_rows; index++) {
         for (int index2 = 0; index2 < num_cols; index2++) {
             for (int size = 1; size + index <= num_rows && size + index2 <= num_cols; size++) {
@@ -254,86 +4017,233 @@ int find_square (int num_rows, int num_cols, int **bitmap, int *start_x, int *st
                     }
                 }
 
-                if (valid && (size > maximum_size || (size == maximum_size && (index < *start_x || (index == *start_x && index2 < *start_y))))) {
-                    maximum_size = size;
-                    *start_x = index;
-                    *start_y = index2;
-                    *end_x = index + size - 1;
-                    *end_y = index2 + size - 1;
+                if (valid && figure_better (figure, size, index, index2)) {
+                    figure->size = size;
+                    figure->start_x = index;
+                    figure->start_y = index2;
+                    figure->end_x = index + size - 1;
+                    figure->end_y = index2 + size - 1;
                 }
             }
         }
     }
+}
 
-    return maximum_size;  
+/**
+ * Function to get the current time of a monotonic clock.
+ * @return Time in seconds.
+ */
+double bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
 /**
- * Main process function to handle the operations.
- * @param filename Name of the text file.
- * @param operation Operation to perform (test, hline, vline, square, --help).
- * @param result Pointer to store the result of the operation.
+ * Function to get the peak resident set size of the process.
+ * @return Peak RSS in kilobytes.
  */
-void process (const char *filename, const char *operation, int *result) {
-    int num_rows, num_cols;
-    int **bitmap;
-    int start_x, start_y, end_x, end_y;
+long bench_peak_rss (void) {
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
 
-    // Check the validity of the file and read the bitmap.
-    *result = validity_check (filename, &num_rows, &num_cols, &bitmap);
-    if (*result != VALID) {
-        return;
-    } 
+/**
+ * Function to print one line of the benchmark report and count the failed checks.
+ * @param kind Kind of the bitmap.
+ * @param what Measured step.
+ * @param seconds Time the step took, negative if it was not timed.
+ * @param pixels Number of pixels of the bitmap.
+ * @param figure Figure found by the step, NULL for parsing.
+ * @param check 1 if the result matches the reference, 0 if not, -1 if not checked.
+ * @param failures Pointer to the number of failed checks.
+ */
+void bench_report (const char *kind, const char *what, double seconds, double pixels, const Figure *figure, int check, int *failures) {
+    char result[64] = "-";
 
-    if (strcmp (operation, "test") == 0) {
-        *result = VALID;
-        return;
+    if (figure != NULL && figure->size > 0) {
+        snprintf (result, sizeof(result), "%d %d %d %d", figure->start_x, figure->start_y, figure->end_x, figure->end_y);
+    } else if (figure != NULL) {
+        snprintf (result, sizeof(result), "none");
     }
 
-    if (strcmp (operation, "--help") == 0) {
-        printf ("Usage: figsearch <operation> <filename>\n" 
-                "Operations:\n"
-                " --help Show this help message and exit.\n" 
-                " test Validate the bitmap file format.\n" 
-                " hline Find the longest horizontal line.\n" 
-                " vline Find the longest vertical line.\n" 
-                " square Find the largest square.\n" 
-                "\n"
-                "Description:\n" 
-                " The figsearch program processes a bitmap file and performs various\n" 
-                " operations to analyze the content.");
+    printf ("%-13s %-14s %10.3f %10.2f %8ld  %-24s %s\n", kind, what, seconds * 1e3, seconds > 0 ? pixels / seconds / 1e6 : 0.0,
+            bench_peak_rss (), result, check < 0 ? "-" : (check ? "ok" : "MISMATCH"));
+    if (check == 0) {
+        (*failures)++;
+    }
+}
 
-    } else if (strcmp (operation, "hline") == 0) {
-        int hline_lenght = find_hline (num_rows, num_cols, bitmap, &start_x, &start_y, &end_x, &end_y);
-        if (hline_lenght > 0) {
-            printf ("%d %d %d %d\n", start_x, start_y, end_x, end_y);
-        } else {
-            printf ("No horizontal line found.\n");
+/**
+ * Function to compare two figures.
+ * @param first First figure.
+ * @param second Second figure.
+ * @return 1 if both are the same figure or both are empty, 0 otherwise.
+ */
+int figure_equal (const Figure *first, const Figure *second) {
+    if (first->size == 0 || second->size == 0) {
+        return first->size == second->size;
+    }
+    return first->size == second->size && first->start_x == second->start_x && first->start_y == second->start_y
+           && first->end_x == second->end_x && first->end_y == second->end_y;
+}
+
+/**
+ * Function to compare two bitmaps.
+ * @param first First bitmap.
+ * @param second Second bitmap.
+ * @return 1 if they have the same size and pixels, 0 otherwise.
+ */
+int bitmap_equal (const Bitmap *first, const Bitmap *second) {
+    return first->num_rows == second->num_rows && first->num_cols == second->num_cols
+           && memcmp (first->words, second->words, (size_t)first->num_rows * first->stride * sizeof(uint64_t)) == 0;
+}
+
+/**
+ * Function to benchmark and check the parsers and all searches on one kind of bitmap.
+ * @param kind Kind of the bitmap, see bench_generate.
+ * @param num_rows Number of rows.
+ * @param num_cols Number of columns.
+ * @param density Share of set pixels of a random bitmap.
+ * @param seed Seed of the generator.
+ * @param jobs Number of threads for the threaded runs.
+ * @param failures Pointer to the number of failed checks.
+ * @return VALID, or MEMORY_ERROR / INVALID_FILE if the case could not be run.
+ */
+int bench_case (const char *kind, int num_rows, int num_cols, double density, uint64_t seed, int jobs, int *failures) {
+    const char *operations[] = { "hline", "vline", "square" };
+    double pixels = (double)num_rows * num_cols;
+    char text_name[64], packed_name[64];
+    Bitmap bitmap, parsed;
+    Figure reference[3], figure;
+    double start;
+
+    if (bitmap_init (&bitmap, num_rows, num_cols) != VALID) {
+        return MEMORY_ERROR;
+    }
+    bench_generate (&bitmap, kind, density, seed);
+
+    // The original implementation; its square search is far too slow for large bitmaps.
+    int **rows = reference_rows (&bitmap);
+    if (rows == NULL) {
+        bitmap_free (&bitmap);
+        return MEMORY_ERROR;
+    }
+    reference_hline (num_rows, num_cols, rows, &reference[0]);
+    reference_vline (num_rows, num_cols, rows, &reference[1]);
+    int verify_square = pixels <= BENCH_VERIFY_PIXELS;
+    if (verify_square) {
+        reference_square (num_rows, num_cols, rows, &reference[2]);
+    }
+    for (int row = 0; row < num_rows; row++) {
+        free (rows[row]);
+    }
+    free (rows);
+
+    if (bench_write (&bitmap, 0, text_name) != VALID || bench_write (&bitmap, 1, packed_name) != VALID) {
+        bitmap_free (&bitmap);
+        return INVALID_FILE;
+    }
+
+    // Parsers: the mapped text file, the text file through a pipe and the packed PBM file.
+    const char *parse_names[] = { "parse text", "parse pipe", "parse p4" };
+    for (int index = 0; index < 3; index++) {
+        start = bench_now ();
+        int status = index == 1 ? bench_parse_pipe (text_name, &parsed) : validity_check (index == 0 ? text_name : packed_name, &parsed);
+        double seconds = bench_now () - start;
+
+        bench_report (kind, parse_names[index], seconds, pixels, NULL, status == VALID && bitmap_equal (&bitmap, &parsed), failures);
+        if (status == VALID) {
+            bitmap_free (&parsed);
         }
+    }
 
-    } else if (strcmp (operation, "vline") == 0) {
-        int vline_lenght = find_vline (num_rows, num_cols, bitmap, &start_x, &start_y, &end_x, &end_y);
-        if (vline_lenght > 0) {
-            printf ("%d %d %d %d\n", start_x, start_y, end_x, end_y);
-        } else {
-            printf ("No vertical line found.\n");
+    // Searches on the loaded bitmap, single threaded and with all threads.
+    for (int index = 0; index < 3; index++) {
+        int check = index < 2 || verify_square;
+        for (int threads = 1; threads <= jobs; threads = threads < jobs ? jobs : jobs + 1) {
+            char what[32];
+            snprintf (what, sizeof(what), "%s -j%d", operations[index], threads);
+
+            start = bench_now ();
+            int status = run_operation (&bitmap, operations[index], threads, &figure);
+            double seconds = bench_now () - start;
+
+            bench_report (kind, what, seconds, pixels, &figure, status == VALID && check ? figure_equal (&figure, &reference[index]) : (status == VALID ? -1 : 0), failures);
         }
+    }
 
-    } else if (strcmp (operation, "square") == 0) {
-        int square_lenght = find_square (num_rows, num_cols, bitmap, &start_x, &start_y, &end_x, &end_y);
-        if (square_lenght > 0) {
-            printf ("%d %d %d %d\n", start_x, start_y, end_x, end_y);
-        } else {
-            printf ("No square found.\n");
+    // Every vertical line kernel the processor supports.
+    VlineKernel kernels[] = { vline_row_scalar,
+#ifdef VLINE_X86
+                              __builtin_cpu_supports ("sse2") ? vline_row_sse2 : NULL,
+                              __builtin_cpu_supports ("avx2") ? vline_row_avx2 : NULL,
+#endif
+    };
+    const char *kernel_names[] = { "vline scalar", "vline sse2", "vline avx2" };
+    for (size_t index = 0; index < sizeof(kernels) / sizeof(kernels[0]); index++) {
+        if (kernels[index] == NULL) {
+            continue;
         }
-    } else {
-        printf ("Unknown operation.\n");
+        bench_kernel = kernels[index];
+        start = bench_now ();
+        int status = find_vline (&bitmap, 1, &figure) < 0 ? MEMORY_ERROR : VALID;
+        double seconds = bench_now () - start;
+        bench_kernel = NULL;
+
+        bench_report (kind, kernel_names[index], seconds, pixels, &figure, status == VALID && figure_equal (&figure, &reference[1]), failures);
     }
 
-    // Free allocated memory.
-    for (int val = 0; val < num_rows; val++) {
-            free (bitmap[val]);
+    // Streaming searches, parsing included.
+    for (int index = 0; index < 2; index++) {
+        char what[32];
+        snprintf (what, sizeof(what), "stream %s", operations[index]);
+
+        start = bench_now ();
+        int status = stream_search (text_name, operations[index], &figure);
+        double seconds = bench_now () - start;
+
+        bench_report (kind, what, seconds, pixels, &figure, status == VALID && figure_equal (&figure, &reference[index]), failures);
+    }
+
+    remove (text_name);
+    remove (packed_name);
+    bitmap_free (&bitmap);
+    return VALID;
+}
+
+/**
+ * Function to run the benchmark: every kind of bitmap at the given size, timing the
+ * parsers and each search and checking them against the original implementation.
+ * @param argc Number of benchmark arguments.
+ * @param argv Benchmark arguments: [rows cols [density [seed]]].
+ * @param options Command line options, -j sets the threads of the threaded runs.
+ * @return VALID if all checks pass, INVALID_FILE if some result does not match.
+ */
+int benchmark (int argc, char *argv[], const Options *options) {
+    const char *kinds[] = { "random", "ones", "checkerboard", "nested", "hline", "vline" };
+    int num_rows = argc >= 2 ? atoi (argv[0]) : 2000;
+    int num_cols = argc >= 2 ? atoi (argv[1]) : 2000;
+    double density = argc >= 3 ? atof (argv[2]) : 0.5;
+    uint64_t seed = argc >= 4 ? strtoull (argv[3], NULL, 10) : 1;
+    int failures = 0;
+
+    if (num_rows <= 0 || num_cols <= 0 || density < 0 || density > 1 || argc == 1 || argc > 4) {
+        fprintf (stderr, "Usage: figsearch [-j N] --bench [rows cols [density [seed]]]\n");
+        return INVALID_ARGS;
     }
 
-    free (bitmap);
-}
\ No newline at end of file
+    printf ("%-13s %-14s %10s %10s %8s  %-24s %s\n", "bitmap", "step", "ms", "Mpx/s", "peak KB", "result", "check");
+    for (size_t index = 0; index < sizeof(kinds) / sizeof(kinds[0]); index++) {
+        int status = bench_case (kinds[index], num_rows, num_cols, density, seed, options->jobs, &failures);
+        if (status != VALID) {
+            fprintf (stderr, "%s: %s\n", kinds[index], status == MEMORY_ERROR ? "Allocation failure" : "Cannot write temporary file");
+            return status;
+        }
+    }
+
+    printf ("%d check(s) failed\n", failures);
+    return failures == 0 ? VALID : INVALID_FILE;
+}
+#endif
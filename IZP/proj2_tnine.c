@@ -1,41 +1,361 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_STRING_LENGHT 102
 #define MAX_NAME 50 
 #define MAX_ARG_LENGHT 250
 
+// Size of the blocks the contacts are read in when the input cannot be mapped.
+#define INPUT_BLOCK (1 << 16)
+
+// Size the output is collected to before it is written.
+#define OUTPUT_BLOCK (1 << 20)
+
+// Size of the windows of piped contacts a scan on several threads splits at once.
+#define SCAN_WINDOW (1 << 24)
+
+// Largest number of threads a scan is split into.
+#define MAX_JOBS 256
+
+// Key written for characters that are not on the keypad, it never matches a query.
+#define T9_NONE '-'
+
+// Tag at the start of an index file and the character between the indexed strings.
+#define INDEX_MAGIC "TNINEIX1"
+#define INDEX_SEPARATOR '\n'
+
+// The vector encoder is built for x86 and picked at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define T9_X86
+#include <immintrin.h>
+#endif
+
+// A growable buffer of characters.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
 // A structure for the contact containing the name, converted name, and phone number.
+// The name and the phone number point into the input and have no line ends, tel_newline
+// tells whether the phone number line had one.
 typedef struct {
-    char name[MAX_STRING_LENGHT];
-    char name2[MAX_STRING_LENGHT];
-    char tel_num[MAX_STRING_LENGHT];
+    const char *name2;
+    size_t name2_length;
+    const char *tel_num;
+    size_t tel_length;
+    bool tel_newline;
+    Buffer name;
 } Contact;
 
+// The input with the contacts. A regular file is mapped whole, anything else is read in
+// blocks into a growing buffer that always holds the whole contact being read. The
+// contacts start at pos, eof is set once nothing more can be read.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+    bool mapped;
+    bool eof;
+} Input;
+
+// A query prepared for Horspool matching.
+typedef struct {
+    const char *query;
+    size_t length;
+    size_t shift[256];
+} Matcher;
+
+// Options of a search. With count only the number of matching contacts is printed,
+// the search stops after limit of them (SIZE_MAX for all) and a scan runs on jobs threads.
+typedef struct {
+    bool count;
+    size_t limit;
+    int jobs;
+} Options;
+
+// A part of the contacts scanned by one thread. The part starts at first and ends at
+// last, lines is the number of line ends in the band of the input the thread counts,
+// output holds the output lines of the matching contacts and count their number. A part
+// stops after limit matches, the matches still missing, the parts before it can only
+// need fewer.
+typedef struct {
+    const char *data;
+    size_t first;
+    size_t last;
+    size_t lines;
+    const Matcher *matcher;
+    const Options *options;
+    size_t limit;
+    Buffer output;
+    size_t count;
+    int status;
+} ScanTask;
+
+// Header of an index file. It is followed by the offsets of the output lines and of the
+// indexed text of every contact (contact_count + 1 of each, as uint64_t), the suffix
+// array and the LCP array (text_size uint32_t each), the indexed text and the output lines.
+typedef struct {
+    char magic[8];
+    uint64_t contact_count;
+    uint64_t text_size;
+    uint64_t records_size;
+} IndexHeader;
+
+// Symbols of the Aho-Corasick automaton: the digits, '+' and one for everything else.
+#define AC_SYMBOLS 12
+#define AC_PLUS 10
+#define AC_OTHER 11
+
+// A state of the Aho-Corasick automaton. Its transitions are complete, dictionary is the
+// nearest state on the failure chain that ends a query (or -1) and first is the first
+// query ending here, the others follow through next_query of the automaton. The depth
+// is the length of the prefix of a query the state stands for.
+typedef struct {
+    int next[AC_SYMBOLS];
+    int depth;
+    int fail;
+    int dictionary;
+    int first;
+} AcState;
+
+// The automaton of a batch of queries and the matches found so far.
+typedef struct {
+    AcState *states;
+    int count;
+    int capacity;
+    char **queries;
+    int query_count;
+    int *next_query;
+    size_t *last_contact;
+    bool match_all;
+    Buffer records;
+    Buffer matches;
+} Batch;
+
+// Encoder of a line of text into keypad digits.
+typedef void (*T9Encoder) (const char *text, size_t length, char *digits);
+
+// Keypad digit of every character, 0 for characters without one.
+static const char t9_keys[256] = {
+    ['+'] = '0',
+    ['a'] = '2', ['b'] = '2', ['c'] = '2', ['A'] = '2', ['B'] = '2', ['C'] = '2',
+    ['d'] = '3', ['e'] = '3', ['f'] = '3', ['D'] = '3', ['E'] = '3', ['F'] = '3',
+    ['g'] = '4', ['h'] = '4', ['i'] = '4', ['G'] = '4', ['H'] = '4', ['I'] = '4',
+    ['j'] = '5', ['k'] = '5', ['l'] = '5', ['J'] = '5', ['K'] = '5', ['L'] = '5',
+    ['m'] = '6', ['n'] = '6', ['o'] = '6', ['M'] = '6', ['N'] = '6', ['O'] = '6',
+    ['p'] = '7', ['q'] = '7', ['r'] = '7', ['s'] = '7', ['P'] = '7', ['Q'] = '7', ['R'] = '7', ['S'] = '7',
+    ['t'] = '8', ['u'] = '8', ['v'] = '8', ['T'] = '8', ['U'] = '8', ['V'] = '8',
+    ['w'] = '9', ['x'] = '9', ['y'] = '9', ['z'] = '9', ['W'] = '9', ['X'] = '9', ['Y'] = '9', ['Z'] = '9',
+};
+
+/**
+ * Encodes text into keypad digits one character at a time with the lookup table.
+ * @param text Text to encode.
+ * @param length Number of characters to encode.
+ * @param digits Output, one digit (or T9_NONE) per character.
+ */
+void t9_encode_scalar(const char *text, size_t length, char *digits) {
+    for (size_t i = 0; i < length; i++) {
+        char key = t9_keys[(unsigned char)text[i]];
+        digits[i] = key != 0 ? key : T9_NONE;
+    }
+}
+
+#ifdef T9_X86
+/**
+ * Encodes text into keypad digits 16 characters at a time. Letters are folded to lower
+ * case and turned into an index from 0 to 25, which two byte shuffles look up in the
+ * keys of a-p and q-z.
+ * @param text Text to encode.
+ * @param length Number of characters to encode.
+ * @param digits Output, one digit (or T9_NONE) per character.
+ */
+__attribute__((target ("ssse3")))
+void t9_encode_ssse3(const char *text, size_t length, char *digits) {
+    const __m128i first_keys = _mm_setr_epi8('2', '2', '2', '3', '3', '3', '4', '4', '4', '5', '5', '5', '6', '6', '6', '7');
+    const __m128i second_keys = _mm_setr_epi8('7', '7', '7', '8', '8', '8', '9', '9', '9', '9', 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i index = _mm_sub_epi8(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(index, _mm_set1_epi8(-1)), _mm_cmplt_epi8(index, _mm_set1_epi8(26)));
+        __m128i second = _mm_cmpgt_epi8(index, _mm_set1_epi8(15));
+        __m128i keys = _mm_or_si128(_mm_andnot_si128(second, _mm_shuffle_epi8(first_keys, index)),
+                                    _mm_and_si128(second, _mm_shuffle_epi8(second_keys, _mm_sub_epi8(index, _mm_set1_epi8(16)))));
+        __m128i plus = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('+'));
+
+        keys = _mm_or_si128(_mm_and_si128(letter, keys), _mm_andnot_si128(letter, _mm_set1_epi8(T9_NONE)));
+        keys = _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8('0')), _mm_andnot_si128(plus, keys));
+        _mm_storeu_si128((__m128i *)(digits + i), keys);
+    }
+    t9_encode_scalar(text + i, length - i, digits + i);
+}
+#endif
+
+/**
+ * Picks the fastest encoder the processor supports.
+ * @return The encoder.
+ */
+T9Encoder t9_select_encoder(void) {
+#ifdef T9_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        return t9_encode_ssse3;
+    }
+#endif
+    return t9_encode_scalar;
+}
+
+// The encoder picked for the processor, the threads of a scan set it up only once.
+static T9Encoder t9_encoder = NULL;
+static pthread_once_t t9_encoder_once = PTHREAD_ONCE_INIT;
+
 /**
- * Converts name characters to numbers according to the telephone keypad.
- * @param name Original name.
- * @param converted_name Converted name.
+ * Sets up the encoder for the processor.
  */
-void convert_name_to_numbers(char name[MAX_STRING_LENGHT], char converted_name[MAX_STRING_LENGHT]){
-    for (int i = 0; i < MAX_STRING_LENGHT && name[i] != '\0'; i++) {
-        name[i] = tolower(name[i]);
-        switch (name[i]) {
-            case '+': converted_name[i] = '0';break;
-            case 'a': case 'b': case 'c': converted_name[i] = '2'; break;
-            case 'd': case 'e': case 'f': converted_name[i] = '3'; break;
-            case 'g': case 'h': case 'i': converted_name[i] = '4'; break;
-            case 'j': case 'k': case 'l': converted_name[i] = '5'; break;
-            case 'm': case 'n': case 'o': converted_name[i] = '6'; break;
-            case 'p': case 'q': case 'r': case 's': converted_name[i] = '7'; break;
-            case 't': case 'u': case 'v': converted_name[i] = '8'; break;
-            case 'w': case 'x': case 'y': case 'z': converted_name[i] = '9'; break;
-            case '\n': converted_name[i] = '\0'; name[i] = '\0'; break;
-            default: break;
+void t9_init_encoder(void) {
+    t9_encoder = t9_select_encoder();
+}
+
+/**
+ * Encodes text into keypad digits, so they can be kept and matched against any number
+ * of queries. Characters that are not on the keypad become T9_NONE.
+ * @param text Text to encode.
+ * @param length Number of characters to encode.
+ * @param digits Output of length + 1 characters, it is terminated by '\0'.
+ */
+void t9_encode(const char *text, size_t length, char *digits) {
+    pthread_once(&t9_encoder_once, t9_init_encoder);
+    t9_encoder(text, length, digits);
+    digits[length] = '\0';
+}
+
+/**
+ * Makes room in a buffer for more characters.
+ * @param buffer The buffer.
+ * @param size Number of characters the buffer must hold after its current ones.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool buffer_reserve(Buffer *buffer, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
         }
-        converted_name[i + 1] = '\0';
+        char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    return true;
+}
+
+/**
+ * Appends characters to a buffer.
+ * @param buffer The buffer.
+ * @param data Characters to append.
+ * @param size Number of characters.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool buffer_append(Buffer *buffer, const char *data, size_t size) {
+    // An empty buffer has no storage to copy nothing into.
+    if (size == 0) {
+        return true;
+    }
+    if (!buffer_reserve(buffer, size)) {
+        return false;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+/**
+ * Converts the name of a contact to numbers according to the telephone keypad.
+ * @param contact The contact, its converted name is kept in name.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool convert_name_to_numbers(Contact *contact) {
+    contact->name.size = 0;
+    if (!buffer_reserve(&contact->name, contact->name2_length + 1)) {
+        return false;
+    }
+    t9_encode(contact->name2, contact->name2_length, contact->name.data);
+    contact->name.size = contact->name2_length;
+    return true;
+}
+
+/**
+ * Converts a name to lower case for printing.
+ * @param name The name.
+ * @param length Length of the name.
+ */
+void lower_name(char *name, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        name[i] = tolower((unsigned char)name[i]);
+    }
+}
+
+/**
+ * Appends the output line of a contact to a buffer: the name in lower case, ", " and
+ * the phone number with its line end.
+ * @param buffer The buffer.
+ * @param contact The contact.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool append_contact(Buffer *buffer, const Contact *contact) {
+    size_t start = buffer->size;
+
+    if (!buffer_append(buffer, contact->name2, contact->name2_length)
+        || !buffer_append(buffer, ", ", 2)
+        || !buffer_append(buffer, contact->tel_num, contact->tel_length)
+        || (contact->tel_newline && !buffer_append(buffer, "\n", 1))) {
+        return false;
+    }
+    lower_name(buffer->data + start, contact->name2_length);
+    return true;
+}
+
+/**
+ * Writes the collected output once it reaches OUTPUT_BLOCK.
+ * @param output The output.
+ * @param force Write all of it, however little there is.
+ */
+void output_flush(Buffer *output, bool force) {
+    if (output->size >= OUTPUT_BLOCK || (force && output->size > 0)) {
+        fwrite(output->data, 1, output->size, stdout);
+        output->size = 0;
+    }
+}
+
+/**
+ * Prints the end of the output of a search: the number of matches with --count, or
+ * "Not found" if there are none.
+ * @param options Options of the search.
+ * @param matches Number of matching contacts.
+ */
+void print_summary(const Options *options, size_t matches) {
+    if (options->count) {
+        printf("%zu\n", matches);
+    } else if (matches == 0) {
+        printf("Not found\n");
     }
 }
 
@@ -49,45 +369,69 @@ void convert_query(char *query) {
     }
 }
 
-/** 
- * Checks if a substring is a part of a string.
- * @param string The main string.
- * @param sub_string The substring.
- * @return true, if the substring is in the string, false otherwise.
+/**
+ * Prepares a query for matching, so that every contact reuses the same shift table.
+ * @param matcher The matcher to prepare.
+ * @param query The query, it must outlive the matcher.
  */
-bool is_substring(char string[],char sub_string[]) {
-    int len = strlen (sub_string);
-    if (len == 0) return true;
-    int first_index = 0;
-    for (int second_index = 0; second_index < MAX_STRING_LENGHT; second_index++){    
-            for (first_index = 0; first_index < len + 1; first_index++){
-                if (len == first_index) {
-                    return true;
-                }
-                if (sub_string[first_index] != string[second_index + first_index]) {
-                    break;
-                }
-            }
+void matcher_init(Matcher *matcher, const char *query) {
+    matcher->query = query;
+    matcher->length = strlen(query);
+
+    // Horspool shifts: how far the window may move when its last character is c.
+    for (int c = 0; c < 256; c++) {
+        matcher->shift[c] = matcher->length;
+    }
+    for (size_t i = 0; i + 1 < matcher->length; i++) {
+        matcher->shift[(unsigned char)query[i]] = matcher->length - 1 - i;
+    }
+}
+
+/**
+ * Checks if the query is a part of a string.
+ * @param matcher The prepared query.
+ * @param string The string to search.
+ * @param length Length of the string.
+ * @return true, if the query is in the string, false otherwise.
+ */
+bool matcher_find(const Matcher *matcher, const char *string, size_t length) {
+    size_t query_length = matcher->length;
+
+    if (query_length == 0) {
+        return true;
+    }
+    if (query_length == 1) {
+        return memchr(string, matcher->query[0], length) != NULL;
+    }
+
+    char last = matcher->query[query_length - 1];
+    for (size_t position = 0; position + query_length <= length; ) {
+        char c = string[position + query_length - 1];
+        if (c == last && memcmp(string + position, matcher->query, query_length - 1) == 0) {
+            return true;
+        }
+        position += matcher->shift[(unsigned char)c];
     }
     return false;
 }
 
 /**
- * Checks if the substring is in the phone number, with the option to convert the first character.
- * @param string The phone number.
- * @param sub_string The substring.
- * @return true, if the substring is in a phone number, false otherwise.
+ * Checks if the query is in the phone number. A number starting with '+' also matches
+ * a query that starts with '0' in place of the '+'.
+ * @param matcher The prepared query.
+ * @param number The phone number.
+ * @param length Length of the phone number.
+ * @return true, if the query is in the phone number, false otherwise.
  */
-bool is_substring_tel(char string[],char sub_string[]) {
-    bool is_sub = false;
-    if (string[0] == '+' && sub_string[0] == '0') {
-        string[0] = '0';
-        is_sub = is_substring(string,sub_string);
-        string[0] = '+';
-    } else {
-        is_sub = is_substring(string,sub_string);
+bool matcher_find_tel(const Matcher *matcher, const char *number, size_t length) {
+    if (length > 0 && number[0] == '+' && matcher->query[0] == '0') {
+        // Only a match at the start can use the '+', the rest cannot contain it.
+        if (length >= matcher->length && memcmp(number + 1, matcher->query + 1, matcher->length - 1) == 0) {
+            return true;
+        }
+        return matcher_find(matcher, number + 1, length - 1);
     }
-    return is_sub;
+    return matcher_find(matcher, number, length);
 }
 
 /**
@@ -105,59 +449,1285 @@ int is_valid_number(const char *str) {
     return 1;
 }
 
+/**
+ * Opens the input with the contacts.
+ * @param input The input to open.
+ * @param fd The file descriptor to read.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool input_open(Input *input, int fd) {
+    struct stat st;
+
+    *input = (Input){0};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+        && lseek(fd, 0, SEEK_CUR) == 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            input->data = map;
+            input->size = (size_t)st.st_size;
+            input->mapped = true;
+            input->eof = true;
+            return true;
+        }
+    }
+
+    input->capacity = INPUT_BLOCK;
+    input->data = malloc(input->capacity);
+    return input->data != NULL;
+}
+
+/**
+ * Reads the next block of the input after the characters not yet taken, the buffer
+ * grows when they fill it.
+ * @param input The input.
+ * @param fd The file descriptor to read.
+ * @return 1 if something was read, 0 at the end of the input, -1 on an error.
+ */
+int input_fill(Input *input, int fd) {
+    if (input->pos > 0) {
+        memmove(input->data, input->data + input->pos, input->size - input->pos);
+        input->size -= input->pos;
+        input->pos = 0;
+    }
+    if (input->size == input->capacity) {
+        char *grown = realloc(input->data, 2 * input->capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure.\n");
+            return -1;
+        }
+        input->data = grown;
+        input->capacity *= 2;
+    }
+
+    ssize_t count;
+    do {
+        count = read(fd, input->data + input->size, input->capacity - input->size);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        fprintf(stderr, "Error reading contacts.\n");
+        return -1;
+    }
+    if (count == 0) {
+        input->eof = true;
+        return 0;
+    }
+    input->size += (size_t)count;
+    return 1;
+}
+
+/**
+ * Closes the input.
+ * @param input The input.
+ */
+void input_close(Input *input) {
+    if (input->mapped) {
+        munmap(input->data, input->size);
+    } else {
+        free(input->data);
+    }
+}
+
+/**
+ * Reads one contact, a line with the name and a line with the phone number. The lines
+ * are taken in place and stay valid until the next contact is read.
+ * @param input The input.
+ * @param contact The contact to fill, its name is converted to numbers.
+ * @return 1 if a contact was read, 0 at the end of the input, -1 on an error.
+ */
+int read_contact(Input *input, Contact *contact) {
+    const char *name_end = NULL, *tel_end = NULL;
+    size_t searched = 0;
+
+    // Both lines must be in the buffer, more is read until they are or the input ends.
+    for (;;) {
+        const char *start = input->data + input->pos;
+        const char *end = input->data + input->size;
+
+        if (name_end == NULL) {
+            name_end = memchr(start + searched, '\n', (size_t)(end - start) - searched);
+        }
+        if (name_end != NULL) {
+            tel_end = memchr(name_end + 1, '\n', (size_t)(end - name_end - 1));
+        }
+        if (tel_end != NULL || input->eof) {
+            break;
+        }
+        searched = (size_t)(end - start);
+        size_t name_offset = name_end == NULL ? 0 : (size_t)(name_end - start);
+        if (input_fill(input, STDIN_FILENO) < 0) {
+            return -1;
+        }
+        if (name_end != NULL) {
+            name_end = input->data + input->pos + name_offset;
+        }
+    }
+
+    const char *start = input->data + input->pos;
+    const char *end = input->data + input->size;
+    if (start == end) {
+        return 0;
+    }
+    // The last phone number may end without a line end, but it must not be empty.
+    if (name_end == NULL || (tel_end == NULL && name_end + 1 == end)) {
+        fprintf(stderr, "Error reading telephone number.\n");
+        return -1;
+    }
+
+    contact->name2 = start;
+    contact->name2_length = (size_t)(name_end - start);
+    contact->tel_num = name_end + 1;
+    contact->tel_newline = tel_end != NULL;
+    if (tel_end == NULL) {
+        tel_end = end;
+    }
+    contact->tel_length = (size_t)(tel_end - contact->tel_num);
+    input->pos = (size_t)(tel_end - input->data) + contact->tel_newline;
+
+    // Convert name to numbers.
+    if (!convert_name_to_numbers(contact)) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Builds the suffix array of a text by prefix doubling: in every round the suffixes
+ * are sorted by their ranks for twice as long prefixes with two counting sorts.
+ * @param text The text.
+ * @param size Length of the text.
+ * @param suffixes Output, the starts of the suffixes in sorted order.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool build_suffix_array(const unsigned char *text, uint32_t size, uint32_t *suffixes) {
+    size_t slots = size > 256 ? size : 256;
+    uint32_t *rank = malloc(size * sizeof(uint32_t) + 1);
+    uint32_t *next = malloc(size * sizeof(uint32_t) + 1);
+    uint32_t *count = calloc(slots + 1, sizeof(uint32_t));
+
+    if (rank == NULL || next == NULL || count == NULL) {
+        free(rank);
+        free(next);
+        free(count);
+        return false;
+    }
+
+    // The first round sorts by single characters.
+    for (uint32_t i = 0; i < size; i++) {
+        count[text[i] + 1]++;
+    }
+    for (size_t c = 0; c < 256; c++) {
+        count[c + 1] += count[c];
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        suffixes[count[text[i]]++] = i;
+        rank[i] = text[i];
+    }
+    uint32_t classes = 256;
+
+    for (uint32_t step = 1; step < size; step *= 2) {
+        // Sorted by the second half: suffixes too short for it first, then the others.
+        uint32_t filled = 0;
+        for (uint32_t i = size - step; i < size; i++) {
+            next[filled++] = i;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            if (suffixes[i] >= step) {
+                next[filled++] = suffixes[i] - step;
+            }
+        }
+
+        // A stable sort by the first half keeps that order among equal first halves.
+        memset(count, 0, (slots + 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < size; i++) {
+            count[rank[i] + 1]++;
+        }
+        for (uint32_t c = 0; c < classes; c++) {
+            count[c + 1] += count[c];
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            suffixes[count[rank[next[i]]]++] = next[i];
+        }
+
+        // New ranks, equal for suffixes whose both halves are equal.
+        next[suffixes[0]] = 0;
+        classes = 1;
+        for (uint32_t i = 1; i < size; i++) {
+            uint32_t current = suffixes[i], previous = suffixes[i - 1];
+            bool same = rank[current] == rank[previous]
+                        && (current + step < size) == (previous + step < size)
+                        && (current + step >= size || rank[current + step] == rank[previous + step]);
+            classes += !same;
+            next[current] = classes - 1;
+        }
+        uint32_t *swap = rank;
+        rank = next;
+        next = swap;
+        if (classes == size) {
+            break;
+        }
+    }
+
+    free(rank);
+    free(next);
+    free(count);
+    return true;
+}
+
+/**
+ * Builds the LCP array with Kasai's algorithm, lcp[i] is the length of the common
+ * prefix of the suffixes i - 1 and i of the suffix array.
+ * @param text The text.
+ * @param size Length of the text.
+ * @param suffixes The suffix array.
+ * @param lcp Output, the LCP array.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool build_lcp(const unsigned char *text, uint32_t size, const uint32_t *suffixes, uint32_t *lcp) {
+    uint32_t *inverse = malloc(size * sizeof(uint32_t) + 1);
+    uint32_t common = 0;
+
+    if (inverse == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        inverse[suffixes[i]] = i;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        if (inverse[i] == 0) {
+            lcp[0] = 0;
+            common = 0;
+            continue;
+        }
+        uint32_t other = suffixes[inverse[i] - 1];
+        while (i + common < size && other + common < size && text[i + common] == text[other + common]) {
+            common++;
+        }
+        lcp[inverse[i]] = common;
+        if (common > 0) {
+            common--;
+        }
+    }
+    free(inverse);
+    return true;
+}
+
+/**
+ * Reads the contacts from the standard input and saves an index of them. The indexed
+ * text holds the converted name and the phone number of every contact, each followed
+ * by INDEX_SEPARATOR.
+ * @param filename Name of the index file.
+ * @return 0 on success, 1 on an error.
+ */
+int build_index(const char *filename) {
+    Contact contact = {0};
+    Input input;
+    Buffer records = {0}, text = {0}, record_offsets = {0}, text_offsets = {0};
+    uint64_t count = 0;
+    int status = 0;
+    bool opened = input_open(&input, STDIN_FILENO);
+    bool ok = opened;
+
+    while (ok && (status = read_contact(&input, &contact)) == 1) {
+        uint64_t offsets[2] = { records.size, text.size };
+        char separator = INDEX_SEPARATOR;
+
+        ok = buffer_append(&record_offsets, (const char *)&offsets[0], sizeof(uint64_t))
+             && buffer_append(&text_offsets, (const char *)&offsets[1], sizeof(uint64_t))
+             && append_contact(&records, &contact)
+             && buffer_append(&text, contact.name.data, contact.name.size)
+             && buffer_append(&text, &separator, 1)
+             && buffer_append(&text, contact.tel_num, contact.tel_length)
+             && buffer_append(&text, &separator, 1);
+        count++;
+    }
+    if (opened) {
+        input_close(&input);
+    }
+    free(contact.name.data);
+
+    uint64_t ends[2] = { records.size, text.size };
+    ok = ok && buffer_append(&record_offsets, (const char *)&ends[0], sizeof(uint64_t))
+         && buffer_append(&text_offsets, (const char *)&ends[1], sizeof(uint64_t));
+
+    uint32_t *suffixes = NULL, *lcp = NULL;
+    if (ok && status == 0 && text.size >= UINT32_MAX) {
+        fprintf(stderr, "Error: The contacts are too large for an index.\n");
+        status = -1;
+    } else if (ok && status == 0) {
+        suffixes = malloc(text.size * sizeof(uint32_t) + 1);
+        lcp = malloc(text.size * sizeof(uint32_t) + 1);
+        ok = suffixes != NULL && lcp != NULL
+             && build_suffix_array((const unsigned char *)text.data, (uint32_t)text.size, suffixes)
+             && build_lcp((const unsigned char *)text.data, (uint32_t)text.size, suffixes, lcp);
+    }
+
+    if (ok && status == 0) {
+        IndexHeader header = { INDEX_MAGIC, count, text.size, records.size };
+        FILE *file = fopen(filename, "wb");
+        bool written = file != NULL
+                       && fwrite(&header, sizeof(header), 1, file) == 1
+                       && fwrite(record_offsets.data, 1, record_offsets.size, file) == record_offsets.size
+                       && fwrite(text_offsets.data, 1, text_offsets.size, file) == text_offsets.size
+                       && fwrite(suffixes, sizeof(uint32_t), text.size, file) == text.size
+                       && fwrite(lcp, sizeof(uint32_t), text.size, file) == text.size
+                       && fwrite(text.data, 1, text.size, file) == text.size
+                       && fwrite(records.data, 1, records.size, file) == records.size;
+        if (file != NULL && fclose(file) != 0) {
+            written = false;
+        }
+        if (!written) {
+            fprintf(stderr, "Error: Cannot write the index.\n");
+            status = -1;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        status = -1;
+    }
+
+    free(records.data);
+    free(text.data);
+    free(record_offsets.data);
+    free(text_offsets.data);
+    free(suffixes);
+    free(lcp);
+    return status == 0 ? 0 : 1;
+}
+
+/**
+ * Compares a suffix of the indexed text with the query.
+ * @param text The indexed text.
+ * @param size Length of the text.
+ * @param start Start of the suffix.
+ * @param query The query.
+ * @param length Length of the query.
+ * @return Negative, zero or positive as the suffix is smaller, starts with the query, or larger.
+ */
+int compare_suffix(const char *text, uint64_t size, uint32_t start, const char *query, size_t length) {
+    size_t available = size - start < length ? size - start : length;
+    int order = memcmp(text + start, query, available);
+    return order != 0 ? order : (available < length ? -1 : 0);
+}
+
+/**
+ * Finds the range of the suffix array whose suffixes start with the query. Its start is
+ * found by binary search and it lasts while the LCP with the previous suffix covers the
+ * whole query.
+ * @param text The indexed text.
+ * @param size Length of the text.
+ * @param suffixes The suffix array.
+ * @param lcp The LCP array.
+ * @param query The query.
+ * @param length Length of the query, at least 1.
+ * @param end Pointer to store the end of the range.
+ * @return Start of the range.
+ */
+size_t find_range(const char *text, uint64_t size, const uint32_t *suffixes, const uint32_t *lcp, const char *query, size_t length, size_t *end) {
+    size_t low = 0, high = size;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_suffix(text, size, suffixes[middle], query, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *end = low;
+    if (low < size && compare_suffix(text, size, suffixes[low], query, length) == 0) {
+        *end = low + 1;
+        while (*end < size && lcp[*end] >= length) {
+            (*end)++;
+        }
+    }
+    return low;
+}
+
+/**
+ * Finds the contacts of the matches in a range of the suffix array.
+ * @param text The indexed text.
+ * @param suffixes The suffix array.
+ * @param text_offsets Start of the indexed text of every contact.
+ * @param count Number of contacts.
+ * @param low Start of the range.
+ * @param high End of the range.
+ * @param at_start Whether only matches at the start of a string count.
+ * @param matches Output, the contact of every match.
+ * @return Number of matches stored.
+ */
+size_t collect_matches(const char *text, const uint32_t *suffixes, const uint64_t *text_offsets, uint64_t count, size_t low, size_t high, bool at_start, uint64_t *matches) {
+    size_t found = 0;
+
+    for (size_t i = low; i < high; i++) {
+        uint32_t start = suffixes[i];
+        if (at_start && start > 0 && text[start - 1] != INDEX_SEPARATOR) {
+            continue;
+        }
+
+        // The contact is the last one whose indexed text starts before the match.
+        size_t first = 0, last = count;
+        while (last - first > 1) {
+            size_t middle = first + (last - first) / 2;
+            if (text_offsets[middle] <= start) {
+                first = middle;
+            } else {
+                last = middle;
+            }
+        }
+        matches[found++] = first;
+    }
+    return found;
+}
+
+/**
+ * Compares two contact numbers for sorting.
+ * @param first The first number.
+ * @param second The second number.
+ * @return Negative, zero or positive as the first is smaller, equal or larger.
+ */
+int compare_contacts(const void *first, const void *second) {
+    uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+    return (a > b) - (a < b);
+}
+
+/**
+ * Answers a query from a mapped index in O(m log n), the suffixes starting with the
+ * query form one range of the suffix array. The contacts are printed in the order
+ * they were read, like the scan of the standard input does.
+ * @param filename Name of the index file.
+ * @param query The query.
+ * @param options Options of the search.
+ * @return 0 on success, 1 on an error.
+ */
+int query_index(const char *filename, const char *query, const Options *options) {
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(IndexHeader)) {
+        fprintf(stderr, "Error: Cannot read the index.\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot read the index.\n");
+        return 1;
+    }
+
+    const IndexHeader *header = map;
+    uint64_t count = header->contact_count, size = header->text_size;
+    bool valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 && size < UINT32_MAX
+                 && count < (uint64_t)info.st_size && header->records_size < (uint64_t)info.st_size
+                 && (uint64_t)info.st_size == sizeof(IndexHeader) + 2 * (count + 1) * sizeof(uint64_t)
+                                               + 2 * size * sizeof(uint32_t) + size + header->records_size;
+    if (!valid) {
+        fprintf(stderr, "Error: Cannot read the index.\n");
+        munmap(map, (size_t)info.st_size);
+        return 1;
+    }
+
+    const uint64_t *record_offsets = (const uint64_t *)(header + 1);
+    const uint64_t *text_offsets = record_offsets + count + 1;
+    const uint32_t *suffixes = (const uint32_t *)(text_offsets + count + 1);
+    const uint32_t *lcp = suffixes + size;
+    const char *text = (const char *)(lcp + size);
+    const char *records = text + size;
+    size_t length = strlen(query);
+    size_t low = 0, high = 0, plus_low = 0, plus_high = 0;
+    char *plus = NULL;
+
+    if (length > 0) {
+        low = find_range(text, size, suffixes, lcp, query, length, &high);
+    }
+
+    // A query starting with '0' also matches numbers starting with '+' in its place. Names
+    // hold no '+', so a '+' right after a separator is the start of a number.
+    if (length > 0 && query[0] == '0') {
+        plus = malloc(length + 1);
+        if (plus != NULL) {
+            memcpy(plus, query, length + 1);
+            plus[0] = '+';
+            plus_low = find_range(text, size, suffixes, lcp, plus, length, &plus_high);
+        }
+    }
+
+    // Every match belongs to the contact whose indexed text it starts in.
+    uint64_t *matches = malloc(((length == 0 ? count : (high - low) + (plus_high - plus_low)) + 1) * sizeof(uint64_t));
+    size_t found = 0;
+    if (matches == NULL || (length > 0 && query[0] == '0' && plus == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        free(matches);
+        free(plus);
+        munmap(map, (size_t)info.st_size);
+        return 1;
+    }
+    if (length == 0) {
+        for (uint64_t contact = 0; contact < count; contact++) {
+            matches[found++] = contact;
+        }
+    }
+    found += collect_matches(text, suffixes, text_offsets, count, low, high, false, matches + found);
+    found += collect_matches(text, suffixes, text_offsets, count, plus_low, plus_high, true, matches + found);
+    free(plus);
+    qsort(matches, found, sizeof(uint64_t), compare_contacts);
+
+    Buffer output = {0};
+    size_t contact_count = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < found && contact_count < options->limit; i++) {
+        if (i == 0 || matches[i] != matches[i - 1]) {
+            uint64_t contact = matches[i];
+            ok = options->count
+                 || buffer_append(&output, records + record_offsets[contact], record_offsets[contact + 1] - record_offsets[contact]);
+            output_flush(&output, false);
+            contact_count++;
+        }
+    }
+    output_flush(&output, true);
+    free(output.data);
+    if (ok) {
+        print_summary(options, contact_count);
+    } else {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+    }
+
+    free(matches);
+    munmap(map, (size_t)info.st_size);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Maps a character to a symbol of the Aho-Corasick automaton.
+ * @param c The character.
+ * @return The symbol.
+ */
+int ac_symbol(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return c == '+' ? AC_PLUS : AC_OTHER;
+}
+
+/**
+ * Adds a new state to the automaton.
+ * @param batch The batch.
+ * @return Index of the state, -1 if there is a memory allocation failure.
+ */
+int ac_add_state(Batch *batch) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        AcState *states = realloc(batch->states, capacity * sizeof(AcState));
+        if (states == NULL) {
+            return -1;
+        }
+        batch->states = states;
+        batch->capacity = capacity;
+    }
+
+    AcState *state = &batch->states[batch->count];
+    for (int symbol = 0; symbol < AC_SYMBOLS; symbol++) {
+        state->next[symbol] = -1;
+    }
+    state->depth = 0;
+    state->fail = 0;
+    state->dictionary = -1;
+    state->first = -1;
+    return batch->count++;
+}
+
+/**
+ * Builds the automaton of the queries: a trie of the queries, then the failure links in
+ * breadth-first order, which also complete the transitions.
+ * @param batch The batch, with its queries set.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool ac_build(Batch *batch) {
+    if (ac_add_state(batch) != 0) {
+        return false;
+    }
+
+    for (int query = 0; query < batch->query_count; query++) {
+        int state = 0;
+        for (const char *c = batch->queries[query]; *c != '\0'; c++) {
+            int symbol = ac_symbol(*c);
+            if (batch->states[state].next[symbol] < 0) {
+                int added = ac_add_state(batch);
+                if (added < 0) {
+                    return false;
+                }
+                batch->states[state].next[symbol] = added;
+                batch->states[added].depth = batch->states[state].depth + 1;
+            }
+            state = batch->states[state].next[symbol];
+        }
+
+        // An empty query ends in the root and matches every contact.
+        if (state == 0) {
+            batch->match_all = true;
+        }
+        batch->next_query[query] = batch->states[state].first;
+        batch->states[state].first = query;
+    }
+
+    int *order = malloc(batch->count * sizeof(int));
+    int head = 0, tail = 0;
+    if (order == NULL) {
+        return false;
+    }
+
+    for (int symbol = 0; symbol < AC_SYMBOLS; symbol++) {
+        int child = batch->states[0].next[symbol];
+        if (child < 0) {
+            batch->states[0].next[symbol] = 0;
+        } else {
+            order[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = order[head++];
+        AcState *current = &batch->states[state];
+        AcState *fail = &batch->states[current->fail];
+
+        current->dictionary = fail->first >= 0 && current->fail != 0 ? current->fail : fail->dictionary;
+        for (int symbol = 0; symbol < AC_SYMBOLS; symbol++) {
+            int child = current->next[symbol];
+            if (child < 0) {
+                current->next[symbol] = fail->next[symbol];
+            } else {
+                batch->states[child].fail = fail->next[symbol];
+                order[tail++] = child;
+            }
+        }
+    }
+    free(order);
+    return true;
+}
+
+/**
+ * Records that the queries ending in a state match the current contact.
+ * @param batch The batch.
+ * @param state The state.
+ * @param contact Number of the contact.
+ * @param record Number of the output line of the contact.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool ac_report(Batch *batch, int state, size_t contact, uint64_t record) {
+    for (int query = batch->states[state].first; query >= 0; query = batch->next_query[query]) {
+        if (batch->last_contact[query] == contact) {
+            continue;
+        }
+        batch->last_contact[query] = contact;
+
+        uint64_t match[2] = { (uint64_t)query, record };
+        if (!buffer_append(&batch->matches, (const char *)match, sizeof(match))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs the automaton over a string and records every query found in it.
+ * @param batch The batch.
+ * @param string The string.
+ * @param length Length of the string.
+ * @param contact Number of the contact.
+ * @param record Number of the output line of the contact.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool ac_scan(Batch *batch, const char *string, size_t length, size_t contact, uint64_t record) {
+    int state = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        state = batch->states[state].next[ac_symbol(string[i])];
+        for (int output = batch->states[state].first >= 0 ? state : batch->states[state].dictionary; output > 0; output = batch->states[output].dictionary) {
+            if (!ac_report(batch, output, contact, record)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Records the queries starting with '0' that match a number starting with '+' when its
+ * '+' is read as '0'. Such a match must start at the beginning of the number, so only
+ * the trie edges are followed, not the failure links.
+ * @param batch The batch.
+ * @param number The phone number, its first character is '+'.
+ * @param length Length of the phone number.
+ * @param contact Number of the contact.
+ * @param record Number of the output line of the contact.
+ * @return true on success, false if there is a memory allocation failure.
+ */
+bool ac_scan_plus(Batch *batch, const char *number, size_t length, size_t contact, uint64_t record) {
+    int state = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        int next = batch->states[state].next[ac_symbol(i == 0 ? '0' : number[i])];
+        // Any other transition goes back up the trie, the match would not start at 0.
+        if (batch->states[next].depth != batch->states[state].depth + 1) {
+            break;
+        }
+        state = next;
+        if (!ac_report(batch, state, contact, record)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads the queries of a batch from a file, one per line.
+ * @param batch The batch.
+ * @param filename Name of the file with the queries.
+ * @return 0 on success, 1 on an error.
+ */
+int read_queries(Batch *batch, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    int capacity = 0;
+
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot read the queries.\n");
+        return 1;
+    }
+    while ((length = getline(&line, &size, file)) >= 0) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (!is_valid_number(line)) {
+            fprintf(stderr, "Error: Invalid characters. Use only digits and '+'.\n");
+            break;
+        }
+        if (batch->query_count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            char **queries = realloc(batch->queries, capacity * sizeof(char *));
+            if (queries == NULL) {
+                fprintf(stderr, "Error: Memory allocation failure.\n");
+                break;
+            }
+            batch->queries = queries;
+        }
+        batch->queries[batch->query_count] = malloc(length + 1);
+        if (batch->queries[batch->query_count] == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure.\n");
+            break;
+        }
+        memcpy(batch->queries[batch->query_count++], line, length + 1);
+    }
+
+    bool complete = feof(file);
+    free(line);
+    fclose(file);
+    return complete ? 0 : 1;
+}
+
+/**
+ * Frees the memory of a batch.
+ * @param batch The batch.
+ */
+void batch_free(Batch *batch) {
+    for (int query = 0; query < batch->query_count; query++) {
+        free(batch->queries[query]);
+    }
+    free(batch->queries);
+    free(batch->states);
+    free(batch->next_query);
+    free(batch->last_contact);
+    free(batch->records.data);
+    free(batch->matches.data);
+}
+
+/**
+ * Searches the contacts for a whole file of queries in a single pass. The queries are
+ * compiled into an Aho-Corasick automaton that every name and number is run through
+ * once. For every query in the order of the file its line followed by a colon is
+ * printed, then the matching contacts as a single query prints them.
+ * @param filename Name of the file with the queries.
+ * @return 0 on success, 1 on an error.
+ */
+int run_batch(const char *filename) {
+    Batch batch = {0};
+    Contact contact = {0};
+    Input input = {0};
+    size_t contact_count = 0;
+    uint64_t record_count = 0;
+    int status = read_queries(&batch, filename);
+
+    if (status == 0 && !input_open(&input, STDIN_FILENO)) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        status = 1;
+    }
+
+    if (status == 0) {
+        batch.next_query = malloc((batch.query_count + 1) * sizeof(int));
+        batch.last_contact = malloc((batch.query_count + 1) * sizeof(size_t));
+        if (batch.next_query == NULL || batch.last_contact == NULL || !ac_build(&batch)) {
+            fprintf(stderr, "Error: Memory allocation failure.\n");
+            status = 1;
+        }
+    }
+    for (int query = 0; status == 0 && query < batch.query_count; query++) {
+        batch.last_contact[query] = SIZE_MAX;
+    }
+
+    bool ok = true;
+    int read = 0;
+    while (status == 0 && ok && (read = read_contact(&input, &contact)) == 1) {
+        size_t matches = batch.matches.size;
+        uint64_t record = record_count;
+        size_t tel_length = contact.tel_length;
+
+        ok = (!batch.match_all || ac_report(&batch, 0, contact_count, record))
+             && ac_scan(&batch, contact.name.data, contact.name.size, contact_count, record)
+             && ac_scan(&batch, contact.tel_num, tel_length, contact_count, record)
+             && (tel_length == 0 || contact.tel_num[0] != '+' || ac_scan_plus(&batch, contact.tel_num, tel_length, contact_count, record));
+
+        // Only the contacts that matched a query keep their output line.
+        if (ok && batch.matches.size > matches) {
+            uint64_t offset = batch.records.size;
+            ok = buffer_append(&batch.records, (const char *)&offset, sizeof(offset))
+                 && append_contact(&batch.records, &contact)
+                 && buffer_append(&batch.records, "", 1);
+            record_count++;
+        }
+        contact_count++;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        status = 1;
+    }
+    if (read < 0) {
+        status = 1;
+    }
+    if (input.data != NULL) {
+        input_close(&input);
+    }
+    free(contact.name.data);
+
+    if (status == 0) {
+        // The output lines are stored as their offset followed by the text, so they are
+        // found again by walking the buffer once.
+        const char **lines = malloc((record_count + 1) * sizeof(char *));
+        size_t *starts = calloc(batch.query_count + 1, sizeof(size_t));
+        uint64_t *sorted = malloc(batch.matches.size + sizeof(uint64_t));
+        const uint64_t *pairs = (const uint64_t *)batch.matches.data;
+        size_t pair_count = batch.matches.size / (2 * sizeof(uint64_t));
+
+        if (lines == NULL || starts == NULL || sorted == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure.\n");
+            status = 1;
+        } else {
+            size_t position = 0;
+            for (uint64_t record = 0; record < record_count; record++) {
+                lines[record] = batch.records.data + position + sizeof(uint64_t);
+                position += sizeof(uint64_t) + strlen(lines[record]) + 1;
+            }
+
+            // Counting sort of the matches by query keeps the contacts in input order.
+            for (size_t i = 0; i < pair_count; i++) {
+                starts[pairs[2 * i] + 1]++;
+            }
+            for (int query = 0; query < batch.query_count; query++) {
+                starts[query + 1] += starts[query];
+            }
+            for (size_t i = 0; i < pair_count; i++) {
+                sorted[starts[pairs[2 * i]]++] = pairs[2 * i + 1];
+            }
+
+            size_t first = 0;
+            for (int query = 0; query < batch.query_count; query++) {
+                printf("%s:\n", batch.queries[query]);
+                if (first == starts[query]) {
+                    printf("Not found\n");
+                }
+                for (; first < starts[query]; first++) {
+                    printf("%s", lines[sorted[first]]);
+                }
+            }
+        }
+        free(lines);
+        free(starts);
+        free(sorted);
+    }
+
+    batch_free(&batch);
+    return status;
+}
+
+/**
+ * Parses a non-negative number given on the command line.
+ * @param text The argument.
+ * @param value Pointer to store the number.
+ * @return true if the whole argument is a non-negative number, false otherwise.
+ */
+bool parse_count(const char *text, long *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return end != text && *end == '\0' && *value >= 0 && errno == 0;
+}
+
+/**
+ * Checks whether the query corresponds to the name or the phone number of a contact.
+ * @param matcher The prepared query.
+ * @param contact The contact.
+ * @return true, if the contact matches, false otherwise.
+ */
+bool contact_matches(const Matcher *matcher, const Contact *contact) {
+    return matcher_find(matcher, contact->name.data, contact->name.size)
+           || matcher_find_tel(matcher, contact->tel_num, contact->tel_length);
+}
+
+/**
+ * Runs the same work on several tasks at once, one thread per task. The first task runs
+ * in the calling thread, and a task whose thread cannot be started runs there as well,
+ * so the work is always done.
+ * @param work Function doing the work of one task.
+ * @param tasks Array of tasks.
+ * @param task_size Size of one task.
+ * @param count Number of tasks, at most MAX_JOBS.
+ */
+void run_parallel(void *(*work)(void *), void *tasks, size_t task_size, int count) {
+    pthread_t threads[MAX_JOBS];
+    bool started[MAX_JOBS] = {0};
+
+    for (int index = 1; index < count; index++) {
+        started[index] = pthread_create(&threads[index], NULL, work, (char *)tasks + index * task_size) == 0;
+    }
+
+    work(tasks);
+    for (int index = 1; index < count; index++) {
+        if (started[index]) {
+            pthread_join(threads[index], NULL);
+        } else {
+            work((char *)tasks + index * task_size);
+        }
+    }
+}
+
+/**
+ * Counts the line ends in the band of a task.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *count_task(void *argument) {
+    ScanTask *task = argument;
+    size_t lines = 0;
+
+    for (size_t i = task->first; i < task->last; i++) {
+        lines += task->data[i] == '\n';
+    }
+    task->lines = lines;
+    return NULL;
+}
+
+/**
+ * Matches the contacts in the part of a task and keeps the output lines of those that
+ * match.
+ * @param argument The task.
+ * @return NULL.
+ */
+void *scan_task(void *argument) {
+    ScanTask *task = argument;
+    Input input = { (char *)task->data + task->first, task->last - task->first, 0, 0, false, true };
+    Contact contact = {0};
+    int read = 0;
+
+    while (task->count < task->limit && (read = read_contact(&input, &contact)) == 1) {
+        if (contact_matches(task->matcher, &contact)) {
+            task->count++;
+            if (!task->options->count && !append_contact(&task->output, &contact)) {
+                fprintf(stderr, "Error: Memory allocation failure.\n");
+                read = -1;
+                break;
+            }
+        }
+    }
+    free(contact.name.data);
+    task->status = read < 0 ? 1 : 0;
+    return NULL;
+}
+
+/**
+ * Finds the start of the first contact at or after a position. Contacts are pairs of
+ * lines, so it is a line start after an even number of line ends.
+ * @param data The contacts.
+ * @param size Length of the contacts.
+ * @param position The position.
+ * @param lines Number of line ends before the position.
+ * @return Start of the contact, size if there is none.
+ */
+size_t contact_start(const char *data, size_t size, size_t position, size_t lines) {
+    if (position > 0 && data[position - 1] != '\n') {
+        const char *end = memchr(data + position, '\n', size - position);
+        if (end == NULL) {
+            return size;
+        }
+        position = (size_t)(end - data) + 1;
+        lines++;
+    }
+    if (lines % 2 == 1) {
+        const char *end = memchr(data + position, '\n', size - position);
+        if (end == NULL) {
+            return size;
+        }
+        position = (size_t)(end - data) + 1;
+    }
+    return position;
+}
+
+/**
+ * Finds the end of the last whole contact in a window of the input, the line end that
+ * closes an even number of lines.
+ * @param data The input.
+ * @param first Start of the window, the start of a contact.
+ * @param size End of the window.
+ * @param lines Number of line ends in the window.
+ * @return End of the last whole contact, first if there is none.
+ */
+size_t window_end(const char *data, size_t first, size_t size, size_t lines) {
+    size_t skip = lines % 2 + 1;
+
+    if (lines < 2) {
+        return first;
+    }
+    while (skip > 0) {
+        size--;
+        skip -= data[size] == '\n';
+    }
+    return size + 1;
+}
+
+/**
+ * Scans the contacts with several threads. The input is taken in windows, a mapped file
+ * is a single one and piped contacts are read up to SCAN_WINDOW at a time, so memory
+ * does not grow with the input. The line ends of a window are counted in bands, so that
+ * every band can be moved to the start of a contact and the window can end after its
+ * last whole contact, the rest is kept for the next window. Then each thread matches
+ * the contacts of its part and the outputs are printed in the order of the input, as
+ * a single thread prints them.
+ * @param input The input.
+ * @param matcher The prepared query.
+ * @param options Options of the search, with the number of threads.
+ * @return 0 on success, 1 on an error.
+ */
+int scan_parallel(Input *input, const Matcher *matcher, const Options *options) {
+    ScanTask tasks[MAX_JOBS] = {0};
+    size_t starts[MAX_JOBS];
+    int jobs = options->jobs > MAX_JOBS ? MAX_JOBS : options->jobs;
+    size_t matches = 0;
+    int status = 0;
+
+    while (status == 0 && matches < options->limit) {
+        while (!input->eof && input->size - input->pos < SCAN_WINDOW) {
+            if (input_fill(input, STDIN_FILENO) < 0) {
+                status = 1;
+                break;
+            }
+        }
+        const char *data = input->data;
+        size_t first = input->pos, size = input->size;
+        if (status != 0 || first == size) {
+            break;
+        }
+
+        // Small windows are not worth a thread per block.
+        int count = jobs;
+        if ((size - first) / INPUT_BLOCK + 1 < (size_t)count) {
+            count = (int)((size - first) / INPUT_BLOCK + 1);
+        }
+        for (int index = 0; index < count; index++) {
+            tasks[index].data = data;
+            tasks[index].first = first + (size - first) * index / count;
+            tasks[index].last = first + (size - first) * (index + 1) / count;
+        }
+        run_parallel(count_task, tasks, sizeof(ScanTask), count);
+
+        size_t lines = 0;
+        for (int index = 0; index < count; index++) {
+            lines += tasks[index].lines;
+        }
+        size_t end = input->eof ? size : window_end(data, first, size, lines);
+        if (end == first) {
+            // Not even one contact fits the window, it grows until one does.
+            if (input_fill(input, STDIN_FILENO) < 0) {
+                status = 1;
+            }
+            continue;
+        }
+
+        lines = 0;
+        for (int index = 0; index < count; index++) {
+            starts[index] = tasks[index].first < end ? contact_start(data, end, tasks[index].first, lines) : end;
+            lines += tasks[index].lines;
+        }
+        for (int index = 0; index < count; index++) {
+            tasks[index].first = starts[index];
+            tasks[index].last = index + 1 < count ? starts[index + 1] : end;
+            tasks[index].matcher = matcher;
+            tasks[index].options = options;
+            tasks[index].limit = options->limit - matches;
+            tasks[index].output.size = 0;
+            tasks[index].count = 0;
+        }
+        run_parallel(scan_task, tasks, sizeof(ScanTask), count);
+
+        // The outputs stop after the part that failed, as the scan stops there, and
+        // after the limit of matches. Every output line but the last one of the input
+        // ends a line.
+        for (int index = 0; index < count && status == 0 && matches < options->limit; index++) {
+            const Buffer *output = &tasks[index].output;
+            size_t taken = tasks[index].count, length = output->size;
+            if (taken > options->limit - matches) {
+                taken = options->limit - matches;
+                length = 0;
+                for (size_t line = 0; !options->count && line < taken; line++) {
+                    length = (size_t)((const char *)memchr(output->data + length, '\n', output->size - length) - output->data) + 1;
+                }
+            } else {
+                status = tasks[index].status;
+            }
+            if (!options->count && length > 0) {
+                fwrite(output->data, 1, length, stdout);
+            }
+            matches += taken;
+        }
+        input->pos = end;
+    }
+
+    for (int index = 0; index < jobs; index++) {
+        free(tasks[index].output.data);
+    }
+    if (status == 0) {
+        print_summary(options, matches);
+    }
+    return status;
+}
+
 /**
  * The main function of the program.
  */
 int main(int argc, char *argv[]) {
-    char arg[MAX_STRING_LENGHT] = {0};
+    const char *arg = "";
+    const char *index = NULL;
+    const char *program = argv[0];
+    Options options = { false, SIZE_MAX, 1 };
+
+    // Build an index of the contacts instead of searching them.
+    if (argc == 3 && strcmp(argv[1], "index") == 0) {
+        return build_index(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+        return run_batch(argv[2]);
+    }
+
+    // Options go before the query, which cannot start with '-'.
+    while (argc >= 2) {
+        long value;
+        if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+            if (!parse_count(argv[2], &value)) {
+                fprintf(stderr, "Error: Invalid number of threads.\n");
+                return 1;
+            }
+            if (value == 0) {
+                value = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            options.jobs = value < 1 ? 1 : (value > MAX_JOBS ? MAX_JOBS : (int)value);
+            argc--;
+            argv++;
+        } else if (argc >= 3 && strcmp(argv[1], "-i") == 0) {
+            index = argv[2];
+            argc--;
+            argv++;
+        } else if (argc >= 3 && strcmp(argv[1], "--limit") == 0) {
+            if (!parse_count(argv[2], &value) || value == 0) {
+                fprintf(stderr, "Error: Invalid limit.\n");
+                return 1;
+            }
+            options.limit = (size_t)value;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--count") == 0) {
+            options.count = true;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
     // Check command line arguments.
     if (argc == 2) {
         if (!is_valid_number(argv[1])) {
             fprintf(stderr, "Error: Invalid characters. Use only digits and '+'.\n");
             return 1;
         }
-        strncpy(arg, argv[1], strlen(argv[1])+ 1);
+        arg = argv[1];
 
-    } else if (argc == 1) {
-        arg[0] = '\0';
-    } else {
-        fprintf(stderr, "Usage %s <query>\n", argv[0]);
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage %s [-j <threads>] [-i <index>] [--count] [--limit <n>] <query>\n       %s -b <queries>\n       %s index <index>\n", program, program, program);
         return 1;
     }
 
-    Contact contacts;
-    int contact_count = 0;
+    if (index != NULL) {
+        return query_index(index, arg, &options);
+    }
 
-    // Reading contacts from input.
-    while (fgets(contacts.name2, MAX_STRING_LENGHT, stdin) != NULL) {
-        if (contacts.name2[strlen(contacts.name2) - 1] != '\n'){
-            fprintf (stderr, "Error: Name exceeds maximum lenght of 100 characters.\n");
-            return 1;
-        }
-        if (fgets(contacts.tel_num, MAX_STRING_LENGHT, stdin) == NULL) {
-            fprintf(stderr, "Error reading telephone number.\n");
-            return 1;
-        }
-        if (strlen(contacts.tel_num) >= MAX_STRING_LENGHT - 1 && contacts.name2[100] != '\n') {
-            fprintf(stderr, "Error: Phone number exceeds maximum length of 100 characters.\n");
-            return 1;
-        }
-        
-        // Convert name to numbers.
-        convert_name_to_numbers (contacts.name2,contacts.name);
+    Contact contacts = {0};
+    Input input;
+    Buffer output = {0};
+    Matcher matcher;
+    size_t contact_count = 0;
+    int status = 0;
+
+    if (!input_open(&input, STDIN_FILENO)) {
+        fprintf(stderr, "Error: Memory allocation failure.\n");
+        return 1;
+    }
+
+    // The query is prepared once for all contacts.
+    matcher_init(&matcher, arg);
+
+    if (options.jobs > 1) {
+        status = scan_parallel(&input, &matcher, &options);
+        input_close(&input);
+        return status;
+    }
 
+    // Reading contacts from input until the limit of matches.
+    while (contact_count < options.limit && (status = read_contact(&input, &contacts)) == 1) {
         // Checking whether the query corresponds to a name or a phone number.
-        if (is_substring(contacts.name,arg) || is_substring_tel(contacts.tel_num,arg)){
+        if (contact_matches(&matcher, &contacts)) {
             contact_count++;
-            printf("%s, %s",contacts.name2,contacts.tel_num);
+            if (!options.count && !append_contact(&output, &contacts)) {
+                fprintf(stderr, "Error: Memory allocation failure.\n");
+                status = -1;
+                break;
+            }
+            output_flush(&output, false);
         }
-
     }
-
-    // If no contacts are found.
-    if (contact_count == 0){
-        printf("Not found\n");
+    output_flush(&output, true);
+    input_close(&input);
+    free(contacts.name.data);
+    free(output.data);
+    if (status < 0) {
+        return 1;
     }
 
+    // The number of contacts found, or that none were.
+    print_summary(&options, contact_count);
+
     return 0;
-}
\ No newline at end of file
+}